@@ -6,21 +6,82 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 /*** Defines ***/
 
 #define KILO_VERSION "0.0.1"
 #define KILO_TAB_STOP 8
 #define KILO_QUIT_TIMES 3
+#define KILO_MAX_THREADS 64
+// Files smaller than this per thread are indexed on a single thread
+#define KILO_SCAN_MIN_CHUNK (1 << 20)
+#define KILO_READ_BLOCK (1 << 20)
+// Bytes of stale highlighting state to redo per idle slice
+#define KILO_SYNTAX_BUDGET (1 << 20)
+// Sizes of the raw input ring and the decoded key queue (powers of two)
+#define KILO_INPUT_BUF 4096
+#define KILO_KEY_QUEUE 1024
+// How long a lone ESC waits for the rest of a sequence, in ms
+#define KILO_ESC_TIMEOUT 50
+// How long an unfinished paste waits for more data before it is inserted
+#define KILO_PASTE_TIMEOUT 1000
+// Least time between two frames while keys keep arriving, in ms
+#define KILO_FRAME_MS 16
+#define KILO_IDLE_TASKS 8
+// iovecs gathered per writev() when saving (two per row)
+#define KILO_SAVE_IOV 1024
+// How often the message bar shows the progress of a background save, in ms
+#define KILO_SAVE_TICK 100
+// Least free space opened in a row's gap buffer when it runs out
+#define KILO_ROW_GAP 64
+// Rows added while editing keep up to this many chars in their own record
+#define KILO_ROW_INLINE 32
+// The row pool's size classes run from 1 << KILO_POOL_MIN to
+// 1 << KILO_POOL_MAX bytes, carved from slabs of KILO_POOL_SLAB
+#define KILO_POOL_MIN 4
+#define KILO_POOL_MAX 12
+#define KILO_POOL_SLAB (1 << 20)
+// Largest keyword table tried before a filetype's keywords are given up on
+#define KILO_KEYWORD_SLOTS (1 << 16)
+// Search strings at least this long skip ahead with Horspool's rule
+#define KILO_HORSPOOL_MIN 16
+// Most matches the search prompt keeps to narrow down as the query grows
+#define KILO_FIND_MAX (1 << 18)
+// Rows per block of a background search; workers claim a block at a time
+#define KILO_FIND_BLOCK (1 << 14)
+// States a regex search's DFA holds before its cache is started over
+#define KILO_RE_STATES 1024
+// Bytes a regex DFA reads between checks on whether to give up
+#define KILO_RE_POLL (1 << 20)
+// Rows longer than this are rendered and highlighted a window at a time
+#define KILO_LONG_ROW (1 << 16)
+// Chars per chunk of a long row, and how far past a chunk the lexer
+// may have to read to finish its last step
+#define KILO_CHUNK 1024
+#define KILO_LEX_MARGIN 64
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
@@ -35,7 +96,9 @@ enum editorKey {
     HOME_KEY,
     END_KEY,
     PAGE_UP,
-    PAGE_DOWN
+    PAGE_DOWN,
+    // A bracketed paste has been read into E.in.paste
+    PASTE_EVENT
 };
 
 enum editorHighlight {
@@ -52,8 +115,34 @@ enum editorHighlight {
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 
+// chars is a view into the mapped file, not a private NUL-terminated copy
+#define ROW_MAPPED (1<<0)
+// The erow itself lives in the block allocated when the file was opened
+#define ROW_BLOCK (1<<1)
+// hl was built with the row starting inside a multi-line comment
+#define ROW_HL_IN_COMMENT (1<<2)
+// tabs and rSize are up to date
+#define ROW_INDEXED (1<<3)
+// chars live in the spare bytes at the end of the erow's own record
+#define ROW_INLINE (1<<4)
+
 /*** Data ***/
 
+/*
+The screen as a grid of cells, stored as one array of glyphs and one
+of attributes so runs of either can be copied whole. An attribute
+holds the SGR foreground colour minus 30 in its low nibble, plus
+CELL_INVERSE for reversed video.
+*/
+typedef struct frame {
+    char *ch;
+    unsigned char *attr;
+} frame;
+
+#define CELL_INVERSE 0x10
+#define CELL_DEFAULT 9 // foreground 39, the terminal's default colour
+#define CELL_ATTRS (CELL_INVERSE * 2)
+
 struct editorSyntax {
     // Name of the filetype that will be displayed to the user.
     char *filetype;
@@ -69,20 +158,406 @@ struct editorSyntax {
     char *multiline_comment_start;
     char *multiline_comment_end;
     int flags;
+    // Perfect hash of keywords, built the first time the filetype is used
+    struct keywordTable *kwTable;
+};
+
+struct keywordSlot {
+    const char *word;
+    int len;
+    unsigned char hl;
+};
+
+struct keywordTable {
+    /*
+    Open table of 2^n slots where every keyword lands in its own slot
+    for `seed`, so classifying an identifier is one hash and at most
+    one compare.
+    */
+    unsigned int seed;
+    unsigned int mask;
+    int maxLen;
+    struct keywordSlot *slot;
+};
+
+// Lexer state at a point in a row, enough to resume highlighting there
+struct lexState {
+    unsigned char in_comment;
+    unsigned char in_line; // inside a single-line comment
+    unsigned char in_string;
+    unsigned char prev_sep;
+    unsigned char prev_hl;
+    // How far the step that crossed this point ran past it, and the hl
+    // it painted on the way
+    unsigned char pending;
+    unsigned char pendingHl;
+};
+
+/*
+A row longer than KILO_LONG_ROW is never rendered whole. It is cut
+into chunks of about KILO_CHUNK chars, each of which knows the render
+column and the lexer state it starts at, so only the chunks under the
+screen are rendered and highlighted. render and hl then hold that
+window, starting at column rOff.
+*/
+struct rowChunk {
+    int cx;
+    int rx;
+    unsigned char hasTab;
+    struct lexState lex;
+};
+
+struct rowChunks {
+    struct rowChunk *c;
+    int n;
+    int cap;
+    int rOff;
+    // The window runs to the end of the row
+    int winEnd;
+};
+
+// A run of render columns with the same highlight. Columns no span
+// covers are HL_NORMAL, so plain text needs none.
+struct hlSpan {
+    int start;
+    int len;
+    unsigned char hl;
+};
+
+/*
+A search string prepared for looking through many rows. Short ones
+are found by testing 16 starting points at once on their first and
+last bytes, and only checking the rest where both agree. Longer ones
+use shift, how far the string can move on past each byte.
+*/
+struct finder {
+    const char *q;
+    int len;
+    int shift[256];
+};
+
+/*
+Regular expressions are parsed into a tree of reNodes, compiled into
+NFA instructions, and run as a DFA whose states are built only when
+the text first leads to them.
+*/
+enum reNodeType {
+    RN_EMPTY,
+    RN_SET,     // a is the index of its byte set
+    RN_BOL,
+    RN_EOL,
+    RN_CAT,     // a then b
+    RN_ALT,     // a or b
+    RN_STAR,
+    RN_PLUS,
+    RN_QUEST
+};
+
+struct reNode {
+    int type;
+    int a;
+    int b;
+};
+
+struct reParser {
+    const char *s;
+    int len;
+    int i;
+    struct reNode *node;
+    int nNode;
+    int nodeCap;
+    unsigned char (*set)[32];
+    int nSet;
+    int setCap;
+};
+
+enum reOp {
+    RE_SET,     // one byte out of set x
+    RE_JMP,     // carry on at x
+    RE_SPLIT,   // carry on at both x and y
+    RE_BOL,     // only at the start of the row
+    RE_EOL,     // only at the end of the row
+    RE_MATCH
+};
+
+// All but RE_JMP and RE_SPLIT carry on at the next instruction
+struct reInst {
+    int op;
+    int x;
+    int y;
+};
+
+struct reProg {
+    struct reInst *inst;
+    int n;
+    int cap;
+    // Bitmaps of the bytes each RE_SET accepts
+    unsigned char (*set)[32];
+    // A string every match contains, so rows without it are skipped
+    char *lit;
+    int litLen;
+    // The same pattern read right to left, sharing set
+    struct reProg *rev;
+};
+
+// A DFA state: the instructions it stands for, sorted
+struct reState {
+    int *pc;
+    int n;
+    int accept;
+    // Whether a match ends here if this is also the end of the row
+    int acceptEnd;
+    // State after each byte, or -1 until the byte is first seen here
+    int next[256];
+};
+
+/*
+The DFA of a program, built as it runs. A floating one starts a new
+match at every byte and finds where the first match ends; the other
+runs from a given start to see how far a match goes. Once it has
+KILO_RE_STATES states they are all thrown away and built again.
+A DFA is only ever used by one thread.
+*/
+struct reDfa {
+    const struct reProg *prog;
+    int floating;
+    struct reState *state;
+    int nState;
+    int cap;
+    // Open hash of states by their instructions
+    int table[KILO_RE_STATES * 2];
+    // Start states in and at the start of a row, or -1
+    int start[2];
+    // Whether an empty row matches, the one place ^ and $ meet
+    int emptyRow;
+    // Counts cache flushes, so a step that caused one doesn't link to it
+    int epoch;
+    // Scratch for building a state: the instructions reached, a stack,
+    // and the pass each instruction was last reached in
+    int *buf;
+    int *stack;
+    int *mark;
+    int gen;
+    // Polled every KILO_RE_POLL bytes if set; once it returns nonzero
+    // runs stop as if nothing matched, and gaveUp is set
+    int (*giveUp)(void);
+    int gaveUp;
+};
+
+/*
+What a search looks for: the query as it is, or as a regular
+expression. The literal a pattern needs is looked for first, so only
+rows that have it are run through the DFAs.
+*/
+struct matcher {
+    struct finder lit;
+    struct reProg *prog;
+    struct reDfa *back;
+    struct reDfa *run;
+    // Whether prog is freed with the matcher; forks share it
+    int own;
+    // Bit i is set if a match starts at s[i], for the s and len they
+    // were last worked out for
+    unsigned char *starts;
+    int startsCap;
+    const char *startsFor;
+    int startsLen;
+};
+
+// Where a search match starts, and its length in chars
+struct findHit {
+    int row;
+    int cx;
+    int len;
+};
+
+// Every match of the first len bytes of the query, in order
+struct findLevel {
+    int len;
+    struct findHit *hit;
+    int n;
+};
+
+// The matches a worker found in one block of rows
+struct findBlock {
+    struct findHit *hit;
+    int n;
+    // Matches in the block, more than n once the job stops keeping them
+    int count;
+    int done;
+};
+
+/*
+A search for every match of a query, run by worker threads while the
+editor carries on. The rows are cut into blocks that the workers claim
+in turn, and the editor joins finished blocks onto the match list in
+order, so the matches nearest the top of the file show up first.
+The workers read chars straight out of the rows, so the job is
+cancelled before anything edits them.
+*/
+struct findJob {
+    int active;
+    char *query;
+    struct matcher m;
+    pthread_t thread[KILO_MAX_THREADS];
+    int nThreads;
+    struct findBlock *block;
+    int nBlocks;
+    // Matches kept before the rest are only counted
+    int max;
+    // Shared with the workers: the next block to claim, whether to
+    // stop, and how many matches the blocks hold between them
+    int next;
+    int cancel;
+    int stored;
+    // Blocks joined onto level so far
+    int merged;
+    int overflow;
+    struct findLevel level;
+    int levelCap;
+};
+
+// A tab in a row: where it is in chars and the column just past it
+struct tabStop {
+    int cx;
+    int rx;
 };
 
 typedef struct erow {
-    int idx;
+    // Leaf of the row tree holding this row. The row's index is
+    // implicit and is recovered with editorRowIndex().
+    struct rowNode *leaf;
     int size;
     int rSize; //render size
+    int flags;
+    // Bytes chars can hold, once the row has a buffer of its own
+    int cap;
     char *chars;
     char *render;
-    unsigned char *hl; // highlight
-    // Each value in hl array will correspond to a character to render
-    // It will tell you whether the character is part of a string, or a comment, or a num...
+    struct hlSpan *hl; // highlight
+    int nHl;
+    // Each span in hl covers characters to render, in order.
+    // It will tell you whether they are part of a string, or a comment, or a num...
+    // render and hl are built on demand and are NULL until a row is
+    // drawn or searched
     int hl_open_comment;
+    // Save generation whose snapshot still shares this row's chars
+    unsigned int snap;
+    // Only set for long rows once they have been highlighted
+    struct rowChunks *chunks;
+    // Every tab in the row, in order. A row without tabs renders as
+    // its chars, so it never gets a render buffer.
+    struct tabStop *tabs;
+    int nTabs;
 } erow;
 
+// Pool block holding an erow added while editing and its inline chars
+#define ROW_RECORD (sizeof(erow) + KILO_ROW_INLINE)
+
+/*
+Rows are kept in a counted B-tree so inserting, deleting and looking
+up a row by index are all O(log n). Every node records how many rows
+live below it; leaves hold the row pointers themselves.
+*/
+#define ROWTREE_FANOUT 64
+
+typedef struct rowNode rowNode;
+
+typedef struct rowIter {
+    // Position of a row in the tree for walking rows in order
+    rowNode *leaf;
+    int slot;
+} rowIter;
+
+struct rowNode {
+    struct rowNode *parent;
+    int isLeaf;
+    int nChild;
+    int count; // number of rows stored below this node
+    union {
+        struct rowNode *node;
+        erow *row;
+    } child[ROWTREE_FANOUT];
+};
+
+enum inputState {
+    IN_GROUND = 0,
+    IN_ESC,
+    IN_CSI,
+    IN_SS3,
+    IN_PASTE
+};
+
+struct inputBuffer {
+    /*
+    Bytes read from the terminal wait in `raw` until the decoder turns
+    them into keys in `keys`. Both are rings indexed by free-running
+    head/tail counters. The decoder keeps its state between reads, so
+    an escape sequence split across two reads still decodes.
+    */
+    unsigned char raw[KILO_INPUT_BUF];
+    unsigned int rawHead, rawTail;
+    int keys[KILO_KEY_QUEUE];
+    unsigned int keyHead, keyTail;
+    enum inputState state;
+    char param[16];
+    int paramLen;
+    // Text between the bracketed paste markers, handed over as one key
+    char *paste;
+    size_t pasteLen, pasteCap;
+};
+
+struct saveJob {
+    /*
+    A save running on a worker thread. rows is a snapshot of every
+    row's chars taken when the save began. Rows stamped with gen share
+    their chars with it and are copied before they are changed, and
+    buffers the editor lets go of meanwhile wait in orphans until the
+    worker is done.
+    */
+    int active;
+    int threaded;
+    unsigned int gen;
+    pthread_t thread;
+    struct iovec *rows;
+    size_t nRows;
+    size_t total;
+    // Written by the worker and read with atomics by the editor
+    size_t written;
+    int done;
+    int err;
+    // The worker writes a byte here when it is done, to wake the editor
+    int wake[2];
+    // E.dirty when the snapshot was taken
+    int dirty;
+    char *fileName;
+    struct poolBlock *orphans;
+    size_t nOrphans, orphanCap;
+    struct timespec start;
+};
+
+/*
+Row records and small row buffers come from a pool of size classes,
+each a power of two. Blocks are carved from large slabs and go back
+on their class's free list when freed, so adding rows and growing
+them rarely calls malloc and never leaves odd-sized holes behind.
+*/
+struct rowPool {
+    void *free[KILO_POOL_MAX - KILO_POOL_MIN + 1];
+    // Unused end of the newest slab
+    char *slab;
+    size_t slabLeft;
+};
+
+// A pool block that is freed once the save reading it is over
+struct poolBlock {
+    void *p;
+    size_t size;
+};
+
+// A slice of deferred work; returns whether there is more left to do
+typedef int (*idleTask)(void);
+
 struct editorConfig {
     // Gloal struct containing editor state
     int cx, cy;
@@ -93,17 +568,86 @@ struct editorConfig {
     int screenRows;
     int screenCols;
     int numRows;
-    erow *row;
+    rowNode *rowRoot;
+    // Rows before syntaxStale have a correct hl_open_comment. Rows after
+    // syntaxStaleEnd were highlighted from their predecessor's current
+    // state, so catching up can stop once it passes it without a change.
+    int syntaxStale;
+    int syntaxStaleEnd;
+    // Mapping (or in-memory copy) of the opened file that unedited
+    // rows point into
+    char *map;
+    size_t mapLen;
     int dirty;
     char *fileName;
+    // What the terminal currently shows, and the frame being composed.
+    // Each refresh only writes the cells that differ between the two.
+    frame frame;
+    frame nextFrame;
+    int frameValid;
+    // Scroll offsets the terminal's frame was drawn with
+    int frameRowOff;
+    int frameColOff;
     char statusmsg[80];
     time_t statusmsg_time;
     struct editorSyntax *syntax;
+    struct inputBuffer in;
+    // Jobs run in turn while waiting for input, oldest first
+    idleTask idle[KILO_IDLE_TASKS];
+    int nIdle;
+    long lastFrame;
+    struct saveJob save;
+    // The one row whose chars hold a gap buffer: chars[0, at) and
+    // chars[at + len, size + len) are the text, with the gap between
+    struct {
+        erow *row;
+        int at;
+        int len;
+    } gap;
+    // Per column highlight the lexer works in before it becomes spans
+    unsigned char *hlBuf;
+    int hlBufCap;
+    // Search hit drawn over the row's own highlighting, if row >= 0
+    struct {
+        int row;
+        int rx;
+        int len;
+    } match;
+    // Match sets of the search query and of its shorter prefixes, so
+    // typing only rechecks the last set and backspace pops back to one
+    struct {
+        char *query;
+        int qLen;
+        // The query is a regular expression, and one that doesn't parse
+        int regex;
+        int bad;
+        // The open prompt's label, redone when ^R switches the mode
+        const char *verb;
+        char prompt[64];
+        struct findLevel *level;
+        int nLevel;
+        int levelCap;
+        // Matches of query found so far, or -1 if not known
+        int count;
+        // Rows edited since their matches were last looked for
+        int staleFrom;
+        int staleTo;
+        // Rows moved by moveBy from moveAt on whose matches haven't
+        // been renumbered yet, while batch is open
+        int moveAt;
+        int moveBy;
+        int batch;
+        struct findJob job;
+    } find;
+    struct rowPool pool;
     struct termios orig_termios;
 };
 
 struct editorConfig E;
 
+// Set from the SIGWINCH handler, picked up by the next refresh
+volatile sig_atomic_t winResized = 0;
+
 /*** Filetypes ***/
 
 char *C_HL_extensions[] = { ".c", ".h", ".cpp", NULL };
@@ -119,7 +663,8 @@ struct editorSyntax HLDB[] = {
         C_HL_extensions,
         C_HL_keywords,
         "//", "/*", "*/",
-        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+        NULL
     },
 };
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
@@ -127,8 +672,26 @@ struct editorSyntax HLDB[] = {
 /*** Prototypes ***/
 
 void editorSetStatusMessage(const char *fmt, ...);
+int editorSyntaxIdle(void);
+int editorRunIdle(void);
+int editorSavePoll(void);
+int editorFindPoll(void);
+void editorFindRowEdited(erow *row);
+void editorFindCharsEdited(erow *row, int at, int delta);
+void editorFindRowsMoved(int at, int delta);
+void editorFindBatch(int on);
+char *editorRowChars(erow *row);
+char *editorRowSpan(erow *row, int from, int to);
+const char *editorRowView(erow *row, int from);
+int editorChunkAt(struct rowChunks *ch, int at, int byRx);
+int editorChunkEnd(erow *row, int k);
+void editorRowBuildChunks(erow *row, int in);
+void editorRowWindow(erow *row, int from, int to);
+void editorRowDropRender(erow *row);
+void editorRowDropChunks(erow *row);
+void editorChunksEdit(erow *row, int at, int delta);
 void editorRefreshScreen(void);
-char *editorPrompt(char *prompt, void (*callback)(char *, int));
+char *editorPrompt(char *prompt, void (*callback)(char *, int), int allowEmpty);
 
 /*** Terminal ***/
 
@@ -148,6 +711,7 @@ void disableRawMode(void) {
     orig_termios is the original terminal settings that are
     reapplied when the program exits
     */
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1) 
         die("tcsetattr");
 }
@@ -165,66 +729,258 @@ void enableRawMode(void) {
     raw.c_oflag &= ~(OPOST);
     raw.c_cflag |= ~(CS8);
     raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    // read() never blocks; waiting for input is done with poll()
     raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 1;
+    raw.c_cc[VTIME] = 0;
         
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+
+    // Bracketed paste: the terminal wraps pasted text in esc[200~ esc[201~
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
-int editorReadKey(void) {
+int editorInputPending(void) {
+    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+    return poll(&pfd, 1, 0) > 0;
+}
+
+int editorWaitInput(int timeout) {
+    // Waits up to timeout ms (forever if negative) for input to arrive.
+    // While a save or a search runs, waiting forever is cut short so its
+    // progress shows, and a save ends it as soon as it is done.
+    struct pollfd pfd[2] = {
+        { STDIN_FILENO, POLLIN, 0 },
+        { E.save.wake[0], POLLIN, 0 }
+    };
+    int nfds = 1;
+    if (timeout < 0 && (E.save.active || E.find.job.active)) {
+        timeout = KILO_SAVE_TICK;
+        nfds = 2;
+    }
+    int ready = poll(pfd, nfds, timeout);
+    if (ready == -1 && errno != EINTR) die("poll");
+    return ready > 0 && (pfd[0].revents & POLLIN);
+}
+
+void editorFillInput(void) {
+    // Drains whatever the terminal has ready into the raw ring in one read
+    struct inputBuffer *in = &E.in;
+    unsigned int used = in->rawTail - in->rawHead;
+    unsigned int at = in->rawTail % KILO_INPUT_BUF;
+    unsigned int room = KILO_INPUT_BUF - used;
+    if (room > KILO_INPUT_BUF - at) room = KILO_INPUT_BUF - at;
+    if (room == 0) return;
+
+    ssize_t nread = read(STDIN_FILENO, &in->raw[at], room);
+    if (nread == -1 && errno != EAGAIN && errno != EINTR) die("read");
+    if (nread > 0) in->rawTail += nread;
+}
+
+void editorQueueKey(int key) {
+    struct inputBuffer *in = &E.in;
+    in->keys[in->keyTail++ % KILO_KEY_QUEUE] = key;
+}
+
+void editorFinishPaste(void) {
+    struct inputBuffer *in = &E.in;
+    editorQueueKey(PASTE_EVENT);
+    in->state = IN_GROUND;
+}
+
+int editorPasteBytes(void) {
     /*
-    Reads single bit at a time unless invalid and return it.
+    Moves the next contiguous run of the raw ring into the paste buffer
+    and looks for the closing esc[201~ in what was added. Bytes after
+    the marker are put back for the decoder. Returns 1 once the paste
+    is complete.
     */
-    int nread;
-    char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-        if (nread == -1 && errno != EAGAIN) die("read");
+    static const char endMark[] = "\x1b[201~";
+    const size_t markLen = sizeof(endMark) - 1;
+    struct inputBuffer *in = &E.in;
+
+    unsigned int at = in->rawHead % KILO_INPUT_BUF;
+    size_t n = in->rawTail - in->rawHead;
+    if (n > KILO_INPUT_BUF - at) n = KILO_INPUT_BUF - at;
+
+    if (in->pasteLen + n > in->pasteCap) {
+        while (in->pasteLen + n > in->pasteCap)
+            in->pasteCap = in->pasteCap ? in->pasteCap * 2 : KILO_INPUT_BUF;
+        in->paste = realloc(in->paste, in->pasteCap);
+        if (in->paste == NULL) die("realloc");
+    }
+    memcpy(&in->paste[in->pasteLen], &in->raw[at], n);
+    in->rawHead += n;
+
+    // The marker may straddle the previous run, so back up a little
+    size_t from = in->pasteLen > markLen ? in->pasteLen - markLen : 0;
+    in->pasteLen += n;
+    while (from + markLen <= in->pasteLen) {
+        char *esc = memchr(&in->paste[from], '\x1b', in->pasteLen - from);
+        if (esc == NULL) break;
+        size_t i = esc - in->paste;
+        if (i + markLen > in->pasteLen) break;
+        if (memcmp(esc, endMark, markLen) == 0) {
+            in->rawHead -= in->pasteLen - (i + markLen);
+            in->pasteLen = i;
+            return 1;
+        }
+        from = i + 1;
+    }
+    return 0;
+}
+
+int editorCsiKey(struct inputBuffer *in, int final) {
+    // Maps a complete CSI sequence to a key, or ESC if it isn't one we know
+    if (final == '~') {
+        // page up and down are esc[5~ and esc[6~
+        in->param[in->paramLen] = '\0';
+        switch (atoi(in->param)) {
+            case 1: return HOME_KEY;
+            case 3: return DEL_KEY;
+            case 4: return END_KEY;
+            case 5: return PAGE_UP;
+            case 6: return PAGE_DOWN;
+            case 7: return HOME_KEY;
+            case 8: return END_KEY;
+        }
+        return '\x1b';
     }
+    switch (final) {
+        case 'A': return ARROW_UP;
+        case 'B': return ARROW_DOWN;
+        case 'C': return ARROW_RIGHT;
+        case 'D': return ARROW_LEFT;
+        case 'H': return HOME_KEY;
+        case 'F': return END_KEY;
+    }
+    return '\x1b';
+}
+
+void editorDecodeInput(void) {
+    /*
+    Runs the raw bytes through the escape-sequence state machine and
+    queues every key it completes. Stops early if the key queue fills.
+    */
+    struct inputBuffer *in = &E.in;
+    while (in->rawHead != in->rawTail &&
+           in->keyTail - in->keyHead < KILO_KEY_QUEUE) {
+        if (in->state == IN_PASTE) {
+            if (!editorPasteBytes()) continue;
+            // Leave the rest until this paste has been consumed
+            editorFinishPaste();
+            break;
+        }
 
-    if (c == '\x1b') {
-        char seq[3];
+        int c = in->raw[in->rawHead++ % KILO_INPUT_BUF];
 
-        // Read the next two bytes into the seq buffer
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+        switch (in->state) {
+            case IN_GROUND:
+                if (c == '\x1b') in->state = IN_ESC;
+                else editorQueueKey(c);
+                break;
 
-        
-        if (seq[0] == '[') {
-            if (seq[1] >= '0' && seq[1] <= '9') {
-                // page up and down are esc[~5 and esc[~6 which is what we are checking for
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
-                if (seq[2] == '~') {
-                    switch (seq[1]) {
-                        case '1': return HOME_KEY;
-                        case '3': return DEL_KEY;
-                        case '4': return END_KEY;
-                        case '5': return PAGE_UP;
-                        case '6': return PAGE_DOWN;
-                        case '7': return HOME_KEY;
-                        case '8': return END_KEY;
-                    }
+            case IN_ESC:
+                if (c == '[') {
+                    in->state = IN_CSI;
+                    in->paramLen = 0;
+                } else if (c == 'O') {
+                    in->state = IN_SS3;
+                } else {
+                    // Not a sequence: a plain ESC, then decode c afresh
+                    editorQueueKey('\x1b');
+                    in->state = IN_GROUND;
+                    in->rawHead--;
                 }
-            } else {
-                switch (seq[1]) {
-                    case 'A': return ARROW_UP;
-                    case 'B': return ARROW_DOWN;
-                    case 'C': return ARROW_RIGHT;
-                    case 'D': return ARROW_LEFT;
-                    case 'H': return HOME_KEY;
-                    case 'F': return END_KEY;
+                break;
+
+            case IN_CSI:
+                if (c == '~' && in->paramLen == 3 &&
+                    memcmp(in->param, "200", 3) == 0) {
+                    in->state = IN_PASTE;
+                    in->pasteLen = 0;
+                } else if (c >= 0x40 && c <= 0x7e) {
+                    editorQueueKey(editorCsiKey(in, c));
+                    in->state = IN_GROUND;
+                } else if (in->paramLen < (int)sizeof(in->param) - 1) {
+                    in->param[in->paramLen++] = c;
+                }
+                break;
+
+            case IN_PASTE:
+                break;
+
+            case IN_SS3:
+                switch (c) {
+                    case 'A': editorQueueKey(ARROW_UP); break;
+                    case 'B': editorQueueKey(ARROW_DOWN); break;
+                    case 'C': editorQueueKey(ARROW_RIGHT); break;
+                    case 'D': editorQueueKey(ARROW_LEFT); break;
+                    case 'H': editorQueueKey(HOME_KEY); break;
+                    case 'F': editorQueueKey(END_KEY); break;
+                    default: editorQueueKey('\x1b'); break;
                 }
+                in->state = IN_GROUND;
+                break;
+        }
+    }
+}
+
+int editorReadKey(void) {
+    /*
+    Returns the next key. Keys come from the decoded queue; only when
+    it is empty does this wait for the terminal, and then everything
+    that has arrived is read at once, so a burst of typing or a paste
+    costs one read rather than one per byte.
+    */
+    struct inputBuffer *in = &E.in;
+
+    while (in->keyHead == in->keyTail) {
+        editorDecodeInput();
+        if (in->keyHead != in->keyTail) break;
+
+        if (in->state == IN_PASTE) {
+            // Insert what arrived if the terminal never closes the paste
+            if (!editorWaitInput(KILO_PASTE_TIMEOUT)) {
+                editorFinishPaste();
+                break;
+            }
+        } else if (in->state != IN_GROUND) {
+            // Half a sequence: give the rest a moment to arrive, else
+            // it was the ESC key on its own
+            if (!editorWaitInput(KILO_ESC_TIMEOUT)) {
+                editorQueueKey('\x1b');
+                in->state = IN_GROUND;
+                break;
             }
-        } else if (seq[0] == 'O') {
-            switch (seq[1]) {
-                case 'H': return HOME_KEY;
-                case 'F': return END_KEY;
+        } else {
+            // Get on with deferred work in slices until a key arrives
+            while (!editorInputPending() && editorRunIdle());
+            if (!editorWaitInput(-1)) {
+                // Redraw at the new size, or with news of a save or a
+                // search, right away rather than on the next key
+                int news = editorSavePoll();
+                news |= editorFindPoll();
+                if (news || winResized) editorRefreshScreen();
+                continue;
             }
         }
+        editorFillInput();
+    }
 
-        return '\x1b';
-    } else {
-        return c;
+    return in->keys[in->keyHead++ % KILO_KEY_QUEUE];
+}
+
+int editorKeyAvailable(void) {
+    // Returns whether a whole key can be read without waiting
+    struct inputBuffer *in = &E.in;
+    if (in->keyHead == in->keyTail) {
+        editorDecodeInput();
+        if (in->keyHead == in->keyTail && editorInputPending()) {
+            editorFillInput();
+            editorDecodeInput();
+        }
     }
+    return in->keyHead != in->keyTail;
 }
 
 int getCursorPosition(int *rows, int *cols) {
@@ -236,6 +992,7 @@ int getCursorPosition(int *rows, int *cols) {
     if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
 
     while (i < sizeof(buf) - 1) {
+        if (!editorWaitInput(1000)) break;
         if (read(STDIN_FILENO, &buf[i], 1) != 1) break;
         // We look for R because the cursor position is stored like:
         // xx;yyR where xx are row nums and yy are col nums
@@ -268,449 +1025,3789 @@ int getWindowSize(int *rows, int *cols) {
     }
 }
 
-/*** Syntax Highlighting***/
+/*** Idle Tasks ***/
 
-int is_separator(int c) {
-    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+long editorMillis(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
 }
 
-void editorUpdateSyntax(erow *row) {
-    row->hl = realloc(row->hl, row->size);
-    memset(row->hl, HL_NORMAL, row->size);
+void editorQueueIdle(idleTask task) {
+    // Adds task to the idle queue unless it is already waiting there
+    for (int i = 0; i < E.nIdle; i++)
+        if (E.idle[i] == task) return;
+    if (E.nIdle < KILO_IDLE_TASKS) E.idle[E.nIdle++] = task;
+}
 
-    if (E.syntax == NULL) return;
+int editorRunIdle(void) {
+    /*
+    Runs one slice of the task at the head of the queue and drops it
+    once it reports it is done. Returns whether any tasks are left.
+    */
+    if (E.nIdle == 0) return 0;
+    if (!E.idle[0]()) {
+        E.nIdle--;
+        memmove(&E.idle[0], &E.idle[1], sizeof(E.idle[0]) * E.nIdle);
+    }
+    return E.nIdle > 0;
+}
 
-    char **keywords = E.syntax->keywords;
+/*** Row Pool ***/
 
-    char *scs = E.syntax->singleline_comment_start;
-    char *mcs = E.syntax->multiline_comment_start;
-    char *mce = E.syntax->multiline_comment_end;
+int poolClass(size_t size) {
+    // Index of the smallest size class that holds size bytes, or -1
+    int k = KILO_POOL_MIN;
+    while (k <= KILO_POOL_MAX && ((size_t)1 << k) < size) k++;
+    return k <= KILO_POOL_MAX ? k - KILO_POOL_MIN : -1;
+}
 
-    int scs_len = scs ? strlen(scs) : 0;
-    int mcs_len = mcs ? strlen(mcs) : 0;
-    int mce_len = mce ? strlen(mce) : 0;
+size_t poolSize(size_t size) {
+    // How many bytes a block asked for with size bytes really holds
+    int k = poolClass(size);
+    return k < 0 ? size : (size_t)1 << (k + KILO_POOL_MIN);
+}
 
-    int prev_sep = 1;
-    int in_string = 0;
-    int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+void *poolAlloc(size_t size) {
+    // Blocks too big for any class come straight from malloc
+    int k = poolClass(size);
+    if (k < 0) {
+        void *p = malloc(size);
+        if (p == NULL) die("malloc");
+        return p;
+    }
 
-    int i = 0;
-    while (i < row->rSize) {
-        char c = row->render[i];;
-        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+    struct rowPool *pool = &E.pool;
+    void *p = pool->free[k];
+    if (p) {
+        pool->free[k] = *(void **)p;
+        return p;
+    }
+    size_t n = (size_t)1 << (k + KILO_POOL_MIN);
+    if (pool->slabLeft < n) {
+        pool->slab = malloc(KILO_POOL_SLAB);
+        if (pool->slab == NULL) die("malloc");
+        pool->slabLeft = KILO_POOL_SLAB;
+    }
+    p = pool->slab;
+    pool->slab += n;
+    pool->slabLeft -= n;
+    return p;
+}
 
-        if (scs_len && !in_string && !in_comment) {
-            if (!strncmp(&row->render[i], scs, scs_len)) {
-                memset(&row->hl[i], HL_COMMENT, row->rSize - 1);
-                break;
-            }
-        }
+void poolFree(void *p, size_t size) {
+    // size is what p was asked for with, or what poolSize() made of it
+    if (p == NULL) return;
+    int k = poolClass(size);
+    if (k < 0) {
+        free(p);
+        return;
+    }
+    *(void **)p = E.pool.free[k];
+    E.pool.free[k] = p;
+}
 
-        if (mcs_len && mce_len && !in_string) {
-            if (in_comment) {
-                row->hl[i] = HL_MLCOMMENT;
-                if (!strncmp(&row->render[i], mce, mce_len)) {
-                    memset(&row->hl[i], HL_COMMENT, mce_len);
-                    i += mce_len;
-                    in_comment = 0;
-                    prev_sep = 1;
-                    continue;
-                } else {
-                    i++;
-                    continue;
-                }
-            } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-                memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-                i += mcs_len;
-                in_comment = 1;
-                continue;
-            }
-        }
+/*** Row Tree ***/
 
-        if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-            if (in_string) {
-                row->hl[i] = HL_STRING;
-                if (c == '\\' && i + 1 < row->rSize) {
-                    row->hl[i + 1] = HL_STRING;
-                    i += 2;
-                    continue;
-                }
-                if (c == in_string) in_string = 0;
-                i++;
-                prev_sep = 1;
-                continue;
-            } else {
-                if (c == '"' || c == '\'') {
-                    in_string = c;
-                    row->hl[i] = HL_STRING;
-                    i++;
-                    continue;
-                }
-            }
-        }
+rowNode *rowNodeNew(int isLeaf) {
+    rowNode *n = malloc(sizeof(rowNode));
+    if (n == NULL) die("malloc");
+    n->parent = NULL;
+    n->isLeaf = isLeaf;
+    n->nChild = 0;
+    n->count = 0;
+    return n;
+}
 
-        if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-            if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
-                (c == '.' && prev_hl == HL_NUMBER)) {
-                row->hl[i] = HL_NUMBER;
-                i++;
-                prev_sep = 0;
-                continue;
-            }
-        }
+int rowNodeSlot(rowNode *parent, rowNode *n) {
+    // Position of n among its parent's children
+    int i;
+    for (i = 0; i < parent->nChild; i++) {
+        if (parent->child[i].node == n) break;
+    }
+    return i;
+}
 
-        if (prev_sep) {
-            int j;
-            for (j = 0; keywords[j]; j++) {
-                int klen = strlen(keywords[j]);
-                int kw2 = keywords[j][klen - 1] == '|';
-                if (kw2) klen--;
-
-                if (!strncmp(&row->render[i], keywords[j], klen) &&
-                    is_separator(row->render[i + klen])) {
-                memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-                i += klen;
-                break;
-                }
-            }
-            if (keywords[j] != NULL) {
-                prev_sep = 0;
-                continue;
-            }
+erow *editorRowAt(int at) {
+    /*
+    Walks down from the root, skipping whole subtrees by their
+    row count until the leaf holding row `at` is reached.
+    */
+    if (at < 0 || at >= E.numRows) return NULL;
+
+    rowNode *n = E.rowRoot;
+    while (!n->isLeaf) {
+        int c;
+        for (c = 0; c < n->nChild - 1; c++) {
+            if (at < n->child[c].node->count) break;
+            at -= n->child[c].node->count;
         }
-
-
-        prev_sep = is_separator(c); 
-        i++; 
+        n = n->child[c].node;
     }
+    return n->child[at].row;
+}
 
-    int changed = (row->hl_open_comment != in_comment);
-    row->hl_open_comment = in_comment;
-    if (changed && row->idx + 1 < E.numRows) {
-        editorUpdateSyntax(&E.row[row->idx + 1]);
+int editorRowIndex(erow *row) {
+    // Inverse of editorRowAt(): sums the rows to the left on the way up
+    rowNode *n = row->leaf;
+    int idx = 0;
+    while (idx < n->nChild && n->child[idx].row != row) idx++;
+
+    while (n->parent) {
+        rowNode *p = n->parent;
+        int slot = rowNodeSlot(p, n);
+        for (int i = 0; i < slot; i++) idx += p->child[i].node->count;
+        n = p;
     }
-
+    return idx;
 }
 
-int editorSyntaxToColor(int hl) {
-    switch (hl) {
-        case HL_COMMENT:
-        case HL_MLCOMMENT: return 32;
-        case HL_STRING: return 35;
-        case HL_MATCH: return 34;
-        case HL_KEYWORD1: return 33;
-        case HL_KEYWORD2: return 36;
-        case HL_NUMBER: return 31;
-        default: return 37;
+void rowNodeAdopt(rowNode *n, int from) {
+    // Point children from `from` onwards back at n after they moved
+    for (int i = from; i < n->nChild; i++) {
+        if (n->isLeaf) n->child[i].row->leaf = n;
+        else n->child[i].node->parent = n;
     }
 }
 
-void editorSelectSyntaxHighlight(void) {
-    E.syntax = NULL;
-    if (E.fileName == NULL) return;
+rowNode *rowNodeSplit(rowNode *n) {
+    /*
+    Moves the upper half of a full node into a new right sibling.
+    A full parent is split first, and splitting the root grows the
+    tree by one level.
+    */
+    if (n->parent && n->parent->nChild == ROWTREE_FANOUT)
+        rowNodeSplit(n->parent);
+
+    rowNode *right = rowNodeNew(n->isLeaf);
+    int half = n->nChild / 2;
+    right->nChild = n->nChild - half;
+    memcpy(right->child, &n->child[half], sizeof(n->child[0]) * right->nChild);
+    n->nChild = half;
+    rowNodeAdopt(right, 0);
+
+    if (n->isLeaf) {
+        right->count = right->nChild;
+    } else {
+        for (int i = 0; i < right->nChild; i++)
+            right->count += right->child[i].node->count;
+    }
+    n->count -= right->count;
+
+    rowNode *p = n->parent;
+    if (p == NULL) {
+        p = rowNodeNew(0);
+        p->nChild = 1;
+        p->child[0].node = n;
+        p->count = n->count + right->count;
+        n->parent = p;
+        E.rowRoot = p;
+    }
+    int slot = rowNodeSlot(p, n) + 1;
+    memmove(&p->child[slot + 1], &p->child[slot],
+            sizeof(p->child[0]) * (p->nChild - slot));
+    p->child[slot].node = right;
+    p->nChild++;
+    right->parent = p;
+
+    return right;
+}
 
-    char *ext = strrchr(E.fileName , '.');
+void rowTreeInsert(int at, erow *row) {
+    if (E.rowRoot == NULL) E.rowRoot = rowNodeNew(1);
 
-    for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-        struct editorSyntax *s = &HLDB[j];
-        unsigned int i = 0;
-        while (s->filematch[i]) {
-            int is_ext = (s->filematch[i][0] == '.');
-            if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-                    (!is_ext && strstr(E.fileName, s->filematch[i]))) {
-                E.syntax = s;
-                
-                int filerow;
-                for (filerow = 0; filerow < E.numRows; filerow++) {
-                    /* Loop through each row in the file and call
-                       editorUpdateSyntax() on it to each highlighting
-                       as soon as the filetype changes.
-                    */
-                    editorUpdateSyntax(&E.row[filerow]);
-                }
-                
-                return; 
-            }
-            i++;
+    rowNode *n = E.rowRoot;
+    while (!n->isLeaf) {
+        int c;
+        for (c = 0; c < n->nChild - 1; c++) {
+            if (at <= n->child[c].node->count) break;
+            at -= n->child[c].node->count;
         }
+        n = n->child[c].node;
     }
-}
-
-/*** Row Operations ***/
 
-int editorRowCxToRx(erow *row, int cx) {
-    int rx = 0;
-    int j;
-    for (j = 0; j < cx; j++) {
-        if (row->chars[j] == '\t')
-            rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
-        rx++;
+    if (n->nChild == ROWTREE_FANOUT) {
+        rowNode *right = rowNodeSplit(n);
+        if (at > n->nChild) {
+            at -= n->nChild;
+            n = right;
+        }
     }
 
-    return rx;
+    memmove(&n->child[at + 1], &n->child[at],
+            sizeof(n->child[0]) * (n->nChild - at));
+    n->child[at].row = row;
+    n->nChild++;
+    row->leaf = n;
+    for (; n; n = n->parent) n->count++;
 }
 
-int editorRowRxToCx(erow *row, int rx) {
-    int cur_rx = 0;
-    int cx;
-    for (cx = 0; cx < row->size; cx++) {
-        if (row->chars[cx] == '\t')
-            cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
-        cur_rx++;
-
-        if (cur_rx > rx) return cx;
-    }
+void rowTreeBuild(erow *rows, int n) {
+    /*
+    Bulk loads an empty tree from a contiguous array of rows, packing
+    full leaves and then stacking full internal levels on top of them.
+    */
+    if (E.rowRoot) free(E.rowRoot);
+    E.rowRoot = rowNodeNew(1);
+    if (n == 0) return;
+
+    int nNodes = (n + ROWTREE_FANOUT - 1) / ROWTREE_FANOUT;
+    rowNode **level = malloc(sizeof(rowNode *) * nNodes);
+    for (int i = 0; i < nNodes; i++) {
+        rowNode *leaf = (i == 0) ? E.rowRoot : rowNodeNew(1);
+        int from = i * ROWTREE_FANOUT;
+        leaf->nChild = (n - from < ROWTREE_FANOUT) ? n - from : ROWTREE_FANOUT;
+        leaf->count = leaf->nChild;
+        for (int j = 0; j < leaf->nChild; j++) {
+            leaf->child[j].row = &rows[from + j];
+            rows[from + j].leaf = leaf;
+        }
+        level[i] = leaf;
+    }
+
+    while (nNodes > 1) {
+        int nParents = (nNodes + ROWTREE_FANOUT - 1) / ROWTREE_FANOUT;
+        for (int i = 0; i < nParents; i++) {
+            rowNode *p = rowNodeNew(0);
+            int from = i * ROWTREE_FANOUT;
+            for (int j = from; j < nNodes && j < from + ROWTREE_FANOUT; j++) {
+                p->child[p->nChild++].node = level[j];
+                p->count += level[j]->count;
+                level[j]->parent = p;
+            }
+            level[i] = p;
+        }
+        nNodes = nParents;
+    }
+    E.rowRoot = level[0];
+    free(level);
+}
+
+erow *rowIterSeek(rowIter *it, int at) {
+    // Points the iterator at row `at` and returns it
+    erow *row = editorRowAt(at);
+    if (row == NULL) return NULL;
+    it->leaf = row->leaf;
+    it->slot = 0;
+    while (it->leaf->child[it->slot].row != row) it->slot++;
+    return row;
+}
+
+erow *rowIterNext(rowIter *it) {
+    /*
+    Steps to the following row, climbing to the next subtree when a
+    leaf runs out. This is amortized O(1) per row.
+    */
+    if (++it->slot < it->leaf->nChild) return it->leaf->child[it->slot].row;
+
+    rowNode *n = it->leaf;
+    int slot;
+    do {
+        if (n->parent == NULL) return NULL;
+        slot = rowNodeSlot(n->parent, n) + 1;
+        n = n->parent;
+    } while (slot >= n->nChild);
+
+    n = n->child[slot].node;
+    while (!n->isLeaf) n = n->child[0].node;
+    it->leaf = n;
+    it->slot = 0;
+    return n->child[0].row;
+}
+
+erow *rowIterPrev(rowIter *it) {
+    // Steps to the preceding row, the mirror image of rowIterNext()
+    if (--it->slot >= 0) return it->leaf->child[it->slot].row;
+
+    rowNode *n = it->leaf;
+    int slot;
+    do {
+        if (n->parent == NULL) return NULL;
+        slot = rowNodeSlot(n->parent, n) - 1;
+        n = n->parent;
+    } while (slot < 0);
+
+    n = n->child[slot].node;
+    while (!n->isLeaf) n = n->child[n->nChild - 1].node;
+    it->leaf = n;
+    it->slot = n->nChild - 1;
+    return n->child[it->slot].row;
+}
+
+void rowNodeUnlink(rowNode *n) {
+    // Removes an empty node from its parent, pruning parents left empty
+    while (n->nChild == 0 && n->parent) {
+        rowNode *p = n->parent;
+        int slot = rowNodeSlot(p, n);
+        memmove(&p->child[slot], &p->child[slot + 1],
+                sizeof(p->child[0]) * (p->nChild - slot - 1));
+        p->nChild--;
+        free(n);
+        n = p;
+    }
+}
+
+void rowNodeMergeLeaf(rowNode *n) {
+    // Folds a sparse leaf into its left neighbour when both fit in one
+    rowNode *p = n->parent;
+    if (p == NULL) return;
+    int slot = rowNodeSlot(p, n);
+    if (slot == 0) return;
+
+    rowNode *left = p->child[slot - 1].node;
+    if (left->nChild + n->nChild > ROWTREE_FANOUT / 2) return;
+
+    memcpy(&left->child[left->nChild], n->child,
+           sizeof(n->child[0]) * n->nChild);
+    int from = left->nChild;
+    left->nChild += n->nChild;
+    left->count += n->count;
+    rowNodeAdopt(left, from);
+
+    n->nChild = 0;
+    n->count = 0;
+    rowNodeUnlink(n);
+}
+
+erow *rowTreeRemove(int at) {
+    if (at < 0 || at >= E.numRows) return NULL;
+
+    rowNode *n = E.rowRoot;
+    while (!n->isLeaf) {
+        int c;
+        for (c = 0; c < n->nChild - 1; c++) {
+            if (at < n->child[c].node->count) break;
+            at -= n->child[c].node->count;
+        }
+        n = n->child[c].node;
+    }
+
+    erow *row = n->child[at].row;
+    memmove(&n->child[at], &n->child[at + 1],
+            sizeof(n->child[0]) * (n->nChild - at - 1));
+    n->nChild--;
+    for (rowNode *m = n; m; m = m->parent) m->count--;
+
+    if (n->nChild == 0) rowNodeUnlink(n);
+    else if (n->nChild < ROWTREE_FANOUT / 4) rowNodeMergeLeaf(n);
+
+    // Collapse a root that only forwards to a single child
+    while (!E.rowRoot->isLeaf && E.rowRoot->nChild == 1) {
+        rowNode *old = E.rowRoot;
+        E.rowRoot = old->child[0].node;
+        E.rowRoot->parent = NULL;
+        free(old);
+    }
+    if (!E.rowRoot->isLeaf && E.rowRoot->nChild == 0) {
+        free(E.rowRoot);
+        E.rowRoot = NULL;
+    }
+
+    return row;
+}
+
+/*** Byte Scanning ***/
+
+unsigned int byteMask16(const char *p, char c) {
+    /*
+    Returns a bitmask with bit i set when p[i] == c, for the 16 bytes
+    starting at p. Uses SSE2 or NEON where available.
+    */
+#if defined(__SSE2__)
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    static const uint8_t bits[16] = {
+        1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128
+    };
+    uint8x16_t eq = vceqq_u8(vld1q_u8((const uint8_t *)p), vdupq_n_u8(c));
+    uint8x16_t m = vandq_u8(eq, vld1q_u8(bits));
+    return vaddv_u8(vget_low_u8(m)) | (vaddv_u8(vget_high_u8(m)) << 8);
+#else
+    unsigned int mask = 0;
+    for (int i = 0; i < 16; i++) {
+        if (p[i] == c) mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+int scanForBytes(const char *s, int i, int len, const char *stops, int nStops) {
+    /*
+    Returns the index of the first byte at or after i that is one of
+    the nStops bytes in stops, or len if there is none. Whole 16-byte
+    blocks are checked with vector compares.
+    */
+    while (i + 16 <= len) {
+        unsigned int mask = 0;
+        for (int k = 0; k < nStops; k++) mask |= byteMask16(&s[i], stops[k]);
+        if (mask) return i + __builtin_ctz(mask);
+        i += 16;
+    }
+    for (; i < len; i++) {
+        for (int k = 0; k < nStops; k++)
+            if (s[i] == stops[k]) return i;
+    }
+    return len;
+}
+
+void finderInit(struct finder *f, const char *q, int len) {
+    f->q = q;
+    f->len = len;
+    if (len < KILO_HORSPOOL_MIN) return;
+    for (int c = 0; c < 256; c++) f->shift[c] = len;
+    for (int i = 0; i < len - 1; i++) f->shift[(unsigned char)q[i]] = len - 1 - i;
+}
+
+int finderFind(const struct finder *f, const char *s, int len) {
+    // Index of the first match in s[0, len), or -1. s needn't end in NUL.
+    const char *q = f->q;
+    int n = f->len;
+    if (n == 0) return 0;
+    if (n > len) return -1;
+    if (n == 1) {
+        const char *p = memchr(s, q[0], len);
+        return p ? p - s : -1;
+    }
+
+    if (n >= KILO_HORSPOOL_MIN) {
+        char last = q[n - 1];
+        for (int i = 0; i + n <= len; i += f->shift[(unsigned char)s[i + n - 1]]) {
+            if (s[i + n - 1] == last && !memcmp(&s[i], q, n - 1)) return i;
+        }
+        return -1;
+    }
+
+    int i = 0;
+    while (i + 15 + n <= len) {
+        unsigned int mask = byteMask16(&s[i], q[0]) &
+                            byteMask16(&s[i + n - 1], q[n - 1]);
+        while (mask) {
+            int k = __builtin_ctz(mask);
+            if (!memcmp(&s[i + k + 1], &q[1], n - 2)) return i + k;
+            mask &= mask - 1;
+        }
+        i += 16;
+    }
+    for (; i + n <= len; i++) {
+        if (s[i] == q[0] && s[i + n - 1] == q[n - 1] &&
+            !memcmp(&s[i + 1], &q[1], n - 2)) return i;
+    }
+    return -1;
+}
+
+/*** Regular Expressions ***/
+
+/*
+Patterns support . [] [^] ^ $ ( ) | * + ? and the escapes \d \w \s
+(and \D \W \S). Any other escaped byte stands for itself. Matches
+are leftmost-longest and never span rows.
+*/
+
+int reAddNode(struct reParser *p, int type, int a, int b) {
+    if (p->nNode == p->nodeCap) {
+        p->nodeCap = p->nodeCap ? p->nodeCap * 2 : 32;
+        p->node = realloc(p->node, sizeof(struct reNode) * p->nodeCap);
+        if (p->node == NULL) die("realloc");
+    }
+    p->node[p->nNode].type = type;
+    p->node[p->nNode].a = a;
+    p->node[p->nNode].b = b;
+    return p->nNode++;
+}
+
+int reNewSet(struct reParser *p) {
+    // An empty byte set, returned as its index
+    if (p->nSet == p->setCap) {
+        p->setCap = p->setCap ? p->setCap * 2 : 16;
+        p->set = realloc(p->set, 32 * p->setCap);
+        if (p->set == NULL) die("realloc");
+    }
+    memset(p->set[p->nSet], 0, 32);
+    return p->nSet++;
+}
+
+void reSetRange(unsigned char *set, int lo, int hi) {
+    for (int c = lo; c <= hi; c++) set[c >> 3] |= 1 << (c & 7);
+}
+
+int reSetClass(unsigned char *set, int c) {
+    /*
+    Adds the bytes of class escape \c to set. Returns 0 if c isn't
+    one, so it stands for itself.
+    */
+    unsigned char cls[32] = {0};
+    switch (tolower(c)) {
+    case 'd':
+        reSetRange(cls, '0', '9');
+        break;
+    case 'w':
+        reSetRange(cls, '0', '9');
+        reSetRange(cls, 'A', 'Z');
+        reSetRange(cls, 'a', 'z');
+        reSetRange(cls, '_', '_');
+        break;
+    case 's':
+        reSetRange(cls, '\t', '\r');
+        reSetRange(cls, ' ', ' ');
+        break;
+    default:
+        return 0;
+    }
+    for (int k = 0; k < 32; k++) set[k] |= isupper(c) ? ~cls[k] : cls[k];
+    return 1;
+}
+
+int reEscape(int c) {
+    // The byte an escape that isn't a class stands for
+    return c == 't' ? '\t' : c;
+}
+
+int reParseAlt(struct reParser *p);
+
+int reParseClass(struct reParser *p) {
+    // A bracket expression, after its '['
+    int k = reNewSet(p);
+    int negate = p->i < p->len && p->s[p->i] == '^';
+    if (negate) p->i++;
+    int first = 1;
+    while (p->i < p->len && (p->s[p->i] != ']' || first)) {
+        first = 0;
+        int lo = (unsigned char)p->s[p->i++];
+        if (lo == '\\') {
+            if (p->i == p->len) return -1;
+            lo = (unsigned char)p->s[p->i++];
+            if (reSetClass(p->set[k], lo)) continue;
+            lo = reEscape(lo);
+        }
+        int hi = lo;
+        if (p->i + 1 < p->len && p->s[p->i] == '-' && p->s[p->i + 1] != ']') {
+            hi = (unsigned char)p->s[p->i + 1];
+            p->i += 2;
+            if (hi == '\\') {
+                if (p->i == p->len) return -1;
+                hi = reEscape((unsigned char)p->s[p->i++]);
+            }
+            if (hi < lo) return -1;
+        }
+        reSetRange(p->set[k], lo, hi);
+    }
+    if (p->i == p->len) return -1;
+    p->i++;
+    if (negate) {
+        for (int b = 0; b < 32; b++) p->set[k][b] = ~p->set[k][b];
+    }
+    return reAddNode(p, RN_SET, k, 0);
+}
+
+int reParseAtom(struct reParser *p) {
+    int c = (unsigned char)p->s[p->i++];
+    int k;
+    switch (c) {
+    case '(': {
+        int n = reParseAlt(p);
+        if (n < 0 || p->i == p->len || p->s[p->i] != ')') return -1;
+        p->i++;
+        return n;
+    }
+    case '[':
+        return reParseClass(p);
+    case '.':
+        k = reNewSet(p);
+        reSetRange(p->set[k], 0, 255);
+        return reAddNode(p, RN_SET, k, 0);
+    case '^':
+        return reAddNode(p, RN_BOL, 0, 0);
+    case '$':
+        return reAddNode(p, RN_EOL, 0, 0);
+    case '*':
+    case '+':
+    case '?':
+        // Nothing to repeat
+        return -1;
+    }
+    k = reNewSet(p);
+    if (c == '\\') {
+        if (p->i == p->len) return -1;
+        c = (unsigned char)p->s[p->i++];
+        if (reSetClass(p->set[k], c)) return reAddNode(p, RN_SET, k, 0);
+        c = reEscape(c);
+    }
+    reSetRange(p->set[k], c, c);
+    return reAddNode(p, RN_SET, k, 0);
+}
+
+int reParseCat(struct reParser *p) {
+    int n = -1;
+    while (p->i < p->len && p->s[p->i] != '|' && p->s[p->i] != ')') {
+        int a = reParseAtom(p);
+        if (a < 0) return -1;
+        for (; p->i < p->len; p->i++) {
+            char q = p->s[p->i];
+            if (q == '*') a = reAddNode(p, RN_STAR, a, 0);
+            else if (q == '+') a = reAddNode(p, RN_PLUS, a, 0);
+            else if (q == '?') a = reAddNode(p, RN_QUEST, a, 0);
+            else break;
+        }
+        n = n < 0 ? a : reAddNode(p, RN_CAT, n, a);
+    }
+    return n < 0 ? reAddNode(p, RN_EMPTY, 0, 0) : n;
+}
+
+int reParseAlt(struct reParser *p) {
+    int n = reParseCat(p);
+    while (n >= 0 && p->i < p->len && p->s[p->i] == '|') {
+        p->i++;
+        int b = reParseCat(p);
+        n = b < 0 ? -1 : reAddNode(p, RN_ALT, n, b);
+    }
+    return n;
+}
+
+int reSetByte(const unsigned char *set) {
+    // The one byte in set, or -1 if it has more or none
+    int c = -1;
+    for (int k = 0; k < 32; k++) {
+        if (set[k] == 0) continue;
+        if (c >= 0 || (set[k] & (set[k] - 1))) return -1;
+        c = k * 8 + __builtin_ctz(set[k]);
+    }
+    return c;
+}
+
+void reMust(struct reParser *p, int k, char *run, int *runLen,
+            char *best, int *bestLen) {
+    /*
+    Finds the longest string of plain bytes in the top-level
+    concatenation, which every match has to contain. A byte repeated
+    with '+' ends one string and starts the next: "ab+c" needs "ab"
+    and "bc".
+    */
+    struct reNode *n = &p->node[k];
+    int c = -1;
+    if (n->type == RN_CAT) {
+        reMust(p, n->a, run, runLen, best, bestLen);
+        reMust(p, n->b, run, runLen, best, bestLen);
+        return;
+    }
+    if (n->type == RN_BOL || n->type == RN_EOL) return;
+    if (n->type == RN_SET) c = reSetByte(p->set[n->a]);
+    if (n->type == RN_PLUS && p->node[n->a].type == RN_SET)
+        c = reSetByte(p->set[p->node[n->a].a]);
+    if (c >= 0) run[(*runLen)++] = c;
+    if (*runLen > *bestLen) {
+        memcpy(best, run, *runLen);
+        *bestLen = *runLen;
+    }
+    if (c < 0) {
+        *runLen = 0;
+    } else if (n->type == RN_PLUS) {
+        run[0] = c;
+        *runLen = 1;
+    }
+}
+
+int reEmit(struct reProg *g, int op, int x, int y) {
+    if (g->n == g->cap) {
+        g->cap = g->cap ? g->cap * 2 : 32;
+        g->inst = realloc(g->inst, sizeof(struct reInst) * g->cap);
+        if (g->inst == NULL) die("realloc");
+    }
+    g->inst[g->n].op = op;
+    g->inst[g->n].x = x;
+    g->inst[g->n].y = y;
+    return g->n++;
+}
+
+void reCompileNode(struct reProg *g, struct reNode *node, int k, int rev) {
+    // Compiles node k, or if rev is set, what matches its matches
+    // read right to left: concatenations run backwards and ^ and $
+    // swap places
+    struct reNode *n = &node[k];
+    int start = g->n;
+    int s, j;
+    switch (n->type) {
+    case RN_SET:
+        reEmit(g, RE_SET, n->a, 0);
+        break;
+    case RN_BOL:
+        reEmit(g, rev ? RE_EOL : RE_BOL, 0, 0);
+        break;
+    case RN_EOL:
+        reEmit(g, rev ? RE_BOL : RE_EOL, 0, 0);
+        break;
+    case RN_CAT:
+        reCompileNode(g, node, rev ? n->b : n->a, rev);
+        reCompileNode(g, node, rev ? n->a : n->b, rev);
+        break;
+    case RN_ALT:
+        s = reEmit(g, RE_SPLIT, start + 1, 0);
+        reCompileNode(g, node, n->a, rev);
+        j = reEmit(g, RE_JMP, 0, 0);
+        g->inst[s].y = g->n;
+        reCompileNode(g, node, n->b, rev);
+        g->inst[j].x = g->n;
+        break;
+    case RN_STAR:
+        s = reEmit(g, RE_SPLIT, start + 1, 0);
+        reCompileNode(g, node, n->a, rev);
+        reEmit(g, RE_JMP, s, 0);
+        g->inst[s].y = g->n;
+        break;
+    case RN_PLUS:
+        reCompileNode(g, node, n->a, rev);
+        reEmit(g, RE_SPLIT, start, g->n + 1);
+        break;
+    case RN_QUEST:
+        s = reEmit(g, RE_SPLIT, start + 1, 0);
+        reCompileNode(g, node, n->a, rev);
+        g->inst[s].y = g->n;
+        break;
+    }
+}
+
+void reFree(struct reProg *g) {
+    if (g == NULL) return;
+    if (g->rev) {
+        free(g->rev->inst);
+        free(g->rev);
+    }
+    free(g->inst);
+    free(g->set);
+    free(g->lit);
+    free(g);
+}
+
+struct reProg *reCompile(const char *pat, int len) {
+    // Compiles pat, or returns NULL if it isn't a valid pattern
+    struct reParser p = { pat, len, 0, NULL, 0, 0, NULL, 0, 0 };
+    int root = reParseAlt(&p);
+    if (root < 0 || p.i < len) {
+        free(p.node);
+        free(p.set);
+        return NULL;
+    }
+
+    struct reProg *g = calloc(1, sizeof(struct reProg));
+    g->rev = calloc(1, sizeof(struct reProg));
+    if (g == NULL || g->rev == NULL) die("calloc");
+    reCompileNode(g, p.node, root, 0);
+    reEmit(g, RE_MATCH, 0, 0);
+    g->set = p.set;
+    reCompileNode(g->rev, p.node, root, 1);
+    reEmit(g->rev, RE_MATCH, 0, 0);
+    g->rev->set = p.set;
+
+    char *run = malloc(len + 1);
+    g->lit = malloc(len + 1);
+    if (run == NULL || g->lit == NULL) die("malloc");
+    int runLen = 0;
+    reMust(&p, root, run, &runLen, g->lit, &g->litLen);
+    free(run);
+    free(p.node);
+    return g;
+}
+
+void reDfaFlush(struct reDfa *d) {
+    for (int k = 0; k < d->nState; k++) free(d->state[k].pc);
+    d->nState = 0;
+    memset(d->table, -1, sizeof(d->table));
+    d->start[0] = d->start[1] = -1;
+    d->epoch++;
+}
+
+void reNewPass(struct reDfa *d) {
+    if (++d->gen == INT_MAX) {
+        memset(d->mark, 0, sizeof(int) * d->prog->n);
+        d->gen = 1;
+    }
+}
+
+void reClosure(struct reDfa *d, int pc, int bol, int atEnd, int *n) {
+    /*
+    Adds to d->buf the instructions reachable from pc without reading
+    a byte, skipping any already reached in this pass. Only a state's
+    RE_SET, RE_EOL and RE_MATCH instructions are kept, since the rest
+    lead on straight away. Past the end of the row RE_EOL leads on too.
+    */
+    const struct reInst *inst = d->prog->inst;
+    if (d->mark[pc] == d->gen) return;
+    d->mark[pc] = d->gen;
+    int top = 0;
+    d->stack[top++] = pc;
+    while (top > 0) {
+        pc = d->stack[--top];
+        int to[2];
+        int nTo = 0;
+        switch (inst[pc].op) {
+        case RE_JMP:
+            to[nTo++] = inst[pc].x;
+            break;
+        case RE_SPLIT:
+            to[nTo++] = inst[pc].y;
+            to[nTo++] = inst[pc].x;
+            break;
+        case RE_BOL:
+            if (bol) to[nTo++] = pc + 1;
+            break;
+        case RE_EOL:
+            if (atEnd) to[nTo++] = pc + 1;
+            else d->buf[(*n)++] = pc;
+            break;
+        default:
+            d->buf[(*n)++] = pc;
+        }
+        for (int k = 0; k < nTo; k++) {
+            if (d->mark[to[k]] == d->gen) continue;
+            d->mark[to[k]] = d->gen;
+            d->stack[top++] = to[k];
+        }
+    }
+}
+
+int reHasMatch(struct reDfa *d, int n) {
+    for (int k = 0; k < n; k++) {
+        if (d->prog->inst[d->buf[k]].op == RE_MATCH) return 1;
+    }
+    return 0;
+}
+
+struct reDfa *reDfaNew(const struct reProg *g, int floating) {
+    struct reDfa *d = calloc(1, sizeof(struct reDfa));
+    if (d == NULL) die("calloc");
+    d->prog = g;
+    d->floating = floating;
+    d->buf = malloc(sizeof(int) * g->n);
+    d->stack = malloc(sizeof(int) * g->n);
+    d->mark = calloc(g->n, sizeof(int));
+    if (d->buf == NULL || d->stack == NULL || d->mark == NULL) die("malloc");
+    reDfaFlush(d);
+    int n = 0;
+    reNewPass(d);
+    reClosure(d, 0, 1, 1, &n);
+    d->emptyRow = reHasMatch(d, n);
+    return d;
+}
+
+void reDfaFree(struct reDfa *d) {
+    if (d == NULL) return;
+    reDfaFlush(d);
+    free(d->state);
+    free(d->buf);
+    free(d->stack);
+    free(d->mark);
+    free(d);
+}
+
+int reIntCmp(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+int reFindState(struct reDfa *d, int n) {
+    // The state made of the n instructions in d->buf, built if it's new
+    qsort(d->buf, n, sizeof(int), reIntCmp);
+    unsigned int h = 2166136261u;
+    for (int k = 0; k < n; k++) h = (h ^ d->buf[k]) * 16777619u;
+    int mask = KILO_RE_STATES * 2 - 1;
+    int slot;
+    for (slot = h & mask; d->table[slot] >= 0; slot = (slot + 1) & mask) {
+        struct reState *st = &d->state[d->table[slot]];
+        if (st->n == n && !memcmp(st->pc, d->buf, sizeof(int) * n))
+            return d->table[slot];
+    }
+
+    if (d->nState == KILO_RE_STATES) {
+        reDfaFlush(d);
+        for (slot = h & mask; d->table[slot] >= 0; slot = (slot + 1) & mask);
+    }
+    if (d->nState == d->cap) {
+        d->cap = d->cap ? d->cap * 2 : 16;
+        d->state = realloc(d->state, sizeof(struct reState) * d->cap);
+        if (d->state == NULL) die("realloc");
+    }
+    struct reState *st = &d->state[d->nState];
+    st->pc = malloc(sizeof(int) * (n ? n : 1));
+    if (st->pc == NULL) die("malloc");
+    memcpy(st->pc, d->buf, sizeof(int) * n);
+    st->n = n;
+    st->accept = reHasMatch(d, n);
+    memset(st->next, -1, sizeof(st->next));
+
+    // See whether the state's RE_EOLs lead on to a match
+    int m = 0;
+    reNewPass(d);
+    for (int k = 0; k < n; k++) {
+        if (d->prog->inst[st->pc[k]].op == RE_EOL)
+            reClosure(d, st->pc[k] + 1, 0, 1, &m);
+    }
+    st->acceptEnd = st->accept || reHasMatch(d, m);
+
+    d->table[slot] = d->nState;
+    return d->nState++;
+}
+
+int reStart(struct reDfa *d, int bol) {
+    if (d->start[bol] < 0) {
+        int n = 0;
+        reNewPass(d);
+        reClosure(d, 0, bol, 0, &n);
+        d->start[bol] = reFindState(d, n);
+    }
+    return d->start[bol];
+}
+
+int reStep(struct reDfa *d, int from, unsigned char c) {
+    // The state after reading c in state from
+    int to = d->state[from].next[c];
+    if (to >= 0) return to;
+
+    const struct reInst *inst = d->prog->inst;
+    int n = 0;
+    reNewPass(d);
+    for (int k = 0; k < d->state[from].n; k++) {
+        int pc = d->state[from].pc[k];
+        if (inst[pc].op == RE_SET && (d->prog->set[inst[pc].x][c >> 3] & (1 << (c & 7))))
+            reClosure(d, pc + 1, 0, 0, &n);
+    }
+    if (d->floating) reClosure(d, 0, 0, 0, &n);
+    int epoch = d->epoch;
+    to = reFindState(d, n);
+    if (d->epoch == epoch) d->state[from].next[c] = to;
+    return to;
+}
+
+int rePoll(struct reDfa *d) {
+    // Whether to stop the run under way
+    if (d->giveUp && d->giveUp()) d->gaveUp = 1;
+    return d->gaveUp;
+}
+
+int reStarts(struct reDfa *d, const char *s, int len, unsigned char *bits) {
+    /*
+    Runs d, the floating DFA of a pattern read right to left, from the
+    end of s back to its start, and sets bit i of bits wherever a match
+    of the pattern starts at s[i]. One pass finds every start, so the
+    first match after any point is a lookup. Returns 0 if it gave up.
+    */
+    memset(bits, 0, len / 8 + 1);
+    if (len == 0) {
+        if (d->emptyRow) bits[0] = 1;
+        return 1;
+    }
+    int st = reStart(d, 1);
+    if (d->state[st].accept) bits[len >> 3] |= 1 << (len & 7);
+    for (int i = len - 1; i >= 0; i--) {
+        if ((len - i) % KILO_RE_POLL == 0 && rePoll(d)) return 0;
+        st = reStep(d, st, s[i]);
+        if (i > 0 ? d->state[st].accept : d->state[st].acceptEnd)
+            bits[i >> 3] |= 1 << (i & 7);
+    }
+    return 1;
+}
+
+int reLongest(struct reDfa *d, const char *s, int len, int at) {
+    // Where the longest match starting at `at` ends, or -1
+    if (len == 0) return d->emptyRow ? 0 : -1;
+    int st = reStart(d, at == 0);
+    int end = d->state[st].accept ? at : -1;
+    for (int i = at; i < len; i++) {
+        if ((i - at) % KILO_RE_POLL == KILO_RE_POLL - 1 && rePoll(d)) return -1;
+        st = reStep(d, st, s[i]);
+        if (d->state[st].n == 0) return end;
+        if (d->state[st].accept) end = i + 1;
+    }
+    return d->state[st].acceptEnd ? len : end;
+}
+
+int matcherInit(struct matcher *m, const char *q, int len, int regex) {
+    // Returns 0 if q is meant as a pattern and doesn't parse
+    m->prog = NULL;
+    m->back = m->run = NULL;
+    m->own = 1;
+    m->starts = NULL;
+    m->startsCap = 0;
+    m->startsFor = NULL;
+    if (!regex) {
+        finderInit(&m->lit, q, len);
+        return 1;
+    }
+    m->prog = reCompile(q, len);
+    if (m->prog == NULL) return 0;
+    finderInit(&m->lit, m->prog->lit, m->prog->litLen);
+    m->back = reDfaNew(m->prog->rev, 1);
+    m->run = reDfaNew(m->prog, 0);
+    return 1;
+}
+
+void matcherFork(struct matcher *m, const struct matcher *from) {
+    // A matcher for another thread, sharing from's pattern
+    *m = *from;
+    m->own = 0;
+    m->starts = NULL;
+    m->startsCap = 0;
+    m->startsFor = NULL;
+    if (m->prog == NULL) return;
+    m->back = reDfaNew(m->prog->rev, 1);
+    m->run = reDfaNew(m->prog, 0);
+}
+
+void matcherFree(struct matcher *m) {
+    reDfaFree(m->back);
+    reDfaFree(m->run);
+    if (m->own) reFree(m->prog);
+    free(m->starts);
+    m->prog = NULL;
+    m->back = m->run = NULL;
+    m->starts = NULL;
+}
+
+void matcherGiveUp(struct matcher *m, int (*giveUp)(void)) {
+    // Lets a pattern search over a long row be cut short, see reDfa
+    if (m->prog == NULL) return;
+    m->back->giveUp = m->run->giveUp = giveUp;
+}
+
+int matcherGaveUp(const struct matcher *m) {
+    return m->prog && (m->back->gaveUp || m->run->gaveUp);
+}
+
+int matcherFind(struct matcher *m, const char *s, int len, int from, int *mLen) {
+    /*
+    Returns where the first match in s[from, len) starts, or -1, and
+    sets *mLen to its length. A pattern's first match is the one that
+    starts first, and the longest of those. Where matches start is
+    found for all of s at once, running the reversed pattern back from
+    its end, as RE2 does; later calls for the same s, which start from
+    past the last match, reuse that. The match's end is then one run
+    forward from its start, so a row costs a pass plus its matches.
+    */
+    if (from > len) return -1;
+    int k = finderFind(&m->lit, &s[from], len - from);
+    if (k < 0) return -1;
+    if (m->prog == NULL) {
+        *mLen = m->lit.len;
+        return from + k;
+    }
+
+    if (from == 0 || s != m->startsFor || len != m->startsLen) {
+        if (m->startsCap < len / 8 + 1) {
+            m->startsCap = len / 8 + 1;
+            free(m->starts);
+            m->starts = malloc(m->startsCap);
+            if (m->starts == NULL) die("malloc");
+        }
+        m->startsFor = NULL;
+        if (!reStarts(m->back, s, len, m->starts)) return -1;
+        m->startsFor = s;
+        m->startsLen = len;
+    }
+
+    // The first start at or after from, a byte of bits at a time
+    int at = from;
+    while (at <= len) {
+        unsigned int bits = m->starts[at >> 3] >> (at & 7);
+        if (bits) {
+            at += __builtin_ctz(bits);
+            break;
+        }
+        at = (at | 7) + 1;
+    }
+    if (at > len) return -1;
+    int e = reLongest(m->run, s, len, at);
+    if (e < 0) return -1;
+    *mLen = e - at;
+    return at;
+}
+
+int matcherAfter(const struct matcher *m, int at, int mLen) {
+    // Where to look for the match after one at `at`. Pattern matches
+    // don't overlap; query matches may, as the query can repeat.
+    if (m->prog == NULL || mLen == 0) return at + 1;
+    return at + mLen;
+}
+
+/*** Syntax Highlighting***/
+
+int is_separator(int c) {
+    // Looked up in a table filled on first use
+    static unsigned char separators[256];
+    static int ready = 0;
+    if (!ready) {
+        for (int b = 0; b < 128; b++) {
+            separators[b] = isspace(b) || b == '\0' ||
+                            strchr(",.()+-/*=~%<>[];", b) != NULL;
+        }
+        ready = 1;
+    }
+    return separators[(unsigned char)c];
+}
+
+unsigned int keywordHash(const char *s, int len, unsigned int seed) {
+    // FNV-1a, perturbed by seed
+    unsigned int h = 2166136261u ^ seed;
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void editorBuildKeywordTable(struct editorSyntax *syntax) {
+    /*
+    Searches for a seed under which no two keywords share a slot,
+    doubling the table whenever a size runs out of seeds. The '|'
+    suffix marking secondary keywords is resolved here, once, and a
+    word listed twice keeps its first entry, as two equal words would
+    share a slot under every seed.
+    */
+    int n = 0;
+    while (syntax->keywords[n]) n++;
+
+    struct keywordSlot *word = malloc(sizeof(struct keywordSlot) * (n ? n : 1));
+    struct keywordTable *kt = malloc(sizeof(struct keywordTable));
+    if (word == NULL || kt == NULL) die("malloc");
+
+    int nWords = 0;
+    for (int j = 0; j < n; j++) {
+        const char *w = syntax->keywords[j];
+        int len = strlen(w);
+        int kw2 = len > 0 && w[len - 1] == '|';
+        if (kw2) len--;
+        if (len == 0) continue;
+
+        int k;
+        for (k = 0; k < nWords; k++)
+            if (word[k].len == len && !memcmp(word[k].word, w, len)) break;
+        if (k < nWords) continue;
+        word[nWords].word = w;
+        word[nWords].len = len;
+        word[nWords].hl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+        nWords++;
+    }
+
+    unsigned int size = 1;
+    while (size < (unsigned int)nWords * 2) size <<= 1;
+    kt->slot = NULL;
+
+    for (; size <= KILO_KEYWORD_SLOTS; size <<= 1) {
+        kt->slot = realloc(kt->slot, sizeof(struct keywordSlot) * size);
+        if (kt->slot == NULL) die("realloc");
+        kt->mask = size - 1;
+        for (kt->seed = 0; kt->seed < 1000; kt->seed++) {
+            memset(kt->slot, 0, sizeof(struct keywordSlot) * size);
+            kt->maxLen = 0;
+            int j;
+            for (j = 0; j < nWords; j++) {
+                struct keywordSlot *s = &kt->slot[
+                    keywordHash(word[j].word, word[j].len, kt->seed) & kt->mask];
+                if (s->word) break;
+                *s = word[j];
+                if (word[j].len > kt->maxLen) kt->maxLen = word[j].len;
+            }
+            if (j == nWords) {
+                free(word);
+                syntax->kwTable = kt;
+                return;
+            }
+        }
+    }
+    errno = EINVAL;
+    die("keyword table");
+}
+
+int editorKeywordLookup(const char *word, int len) {
+    // Classifies a whole identifier as HL_KEYWORD1, HL_KEYWORD2 or HL_NORMAL
+    struct keywordTable *kt = E.syntax->kwTable;
+    if (len == 0 || len > kt->maxLen) return HL_NORMAL;
+
+    struct keywordSlot *s = &kt->slot[keywordHash(word, len, kt->seed) & kt->mask];
+    if (s->word && s->len == len && !memcmp(s->word, word, len)) return s->hl;
+    return HL_NORMAL;
+}
+
+/*
+One run of the lexer over s[0, len). It paints into hl[0, hlEnd) if
+hl is set, and stops at the first step boundary at or past `end`, or
+where the hl it replaces starts to agree again (see
+editorHighlightFrom()). Each mark gets the state the lexer carried
+across it; scans that could run a long way stop at the next mark, so
+that state is the same however far the run started before it.
+*/
+struct lexer {
+    const char *s;
+    int len;
+    unsigned char *hl;
+    int hlEnd;
+    int end;
+    int stop;
+    struct lexState st;
+    struct rowChunk *marks;
+    int nMarks;
+    // Offset of s in the row the marks' cx refer to
+    int markBase;
+};
+
+void editorLexPaint(struct lexer *L, int from, int to, int hl) {
+    if (to <= from) return;
+    L->st.prev_hl = hl;
+    if (L->hl == NULL) return;
+    if (to > L->hlEnd) to = L->hlEnd;
+    if (from < to) memset(&L->hl[from], hl, to - from);
+}
+
+int editorLex(struct lexer *L, int i) {
+    // Runs L from i and returns where it stopped
+    char *scs = E.syntax->singleline_comment_start;
+    char *mcs = E.syntax->multiline_comment_start;
+    char *mce = E.syntax->multiline_comment_end;
+
+    int scs_len = scs ? strlen(scs) : 0;
+    int mcs_len = mcs ? strlen(mcs) : 0;
+    int mce_len = mce ? strlen(mce) : 0;
+    int kwMax = E.syntax->kwTable->maxLen;
+
+    const char *s = L->s;
+    int len = L->len;
+    struct lexState *st = &L->st;
+    // Where the last step began, and the hl it found there
+    int stepAt = -1;
+    unsigned char stepOld = HL_NORMAL;
+
+    // Finish the step that was under way where this run resumes
+    if (st->pending) {
+        editorLexPaint(L, i, i + st->pending, st->pendingHl);
+        i += st->pending;
+        st->pending = 0;
+        st->pendingHl = 0;
+    }
+    int mark = 0;
+    while (mark < L->nMarks && L->marks[mark].cx - L->markBase < i) mark++;
+
+    for (;;) {
+        while (mark < L->nMarks && L->marks[mark].cx - L->markBase <= i) {
+            struct lexState *m = &L->marks[mark].lex;
+            *m = *st;
+            m->pending = i - (L->marks[mark].cx - L->markBase);
+            m->pendingHl = m->pending ? st->prev_hl : 0;
+            mark++;
+        }
+        if (i >= len || i >= L->end) break;
+        int cap = len;
+        if (mark < L->nMarks && L->marks[mark].cx - L->markBase < len)
+            cap = L->marks[mark].cx - L->markBase;
+
+        if (L->stop >= 0 && i > L->stop && stepAt == i - 1 &&
+            stepOld == HL_NORMAL && L->hl[i - 1] == HL_NORMAL &&
+            is_separator(s[i - 1]) && !st->in_string && !st->in_comment &&
+            !st->in_line)
+            break;
+        if (L->stop >= 0) {
+            stepAt = i;
+            stepOld = L->hl[i];
+        }
+
+        char c = s[i];
+        unsigned char prev_hl = st->prev_hl;
+
+        if (st->in_line) {
+            editorLexPaint(L, i, cap, HL_COMMENT);
+            i = cap;
+            continue;
+        }
+
+        if (scs_len && !st->in_string && !st->in_comment) {
+            if (c == scs[0] && len - i >= scs_len &&
+                !strncmp(&s[i], scs, scs_len)) {
+                // The rest of the row is comment
+                st->in_line = 1;
+                continue;
+            }
+        }
+
+        if (mcs_len && mce_len && !st->in_string) {
+            if (st->in_comment) {
+                // Nothing but the comment's end matters, so jump to it
+                int end = scanForBytes(s, i, cap, mce, 1);
+                editorLexPaint(L, i, end, HL_MLCOMMENT);
+                i = end;
+                if (i == cap) continue;
+
+                if (len - i >= mce_len && !strncmp(&s[i], mce, mce_len)) {
+                    editorLexPaint(L, i, i + mce_len, HL_COMMENT);
+                    i += mce_len;
+                    st->in_comment = 0;
+                    st->prev_sep = 1;
+                } else {
+                    editorLexPaint(L, i, i + 1, HL_MLCOMMENT);
+                    i++;
+                }
+                continue;
+            } else if (c == mcs[0] && len - i >= mcs_len &&
+                       !strncmp(&s[i], mcs, mcs_len)) {
+                editorLexPaint(L, i, i + mcs_len, HL_MLCOMMENT);
+                i += mcs_len;
+                st->in_comment = 1;
+                continue;
+            }
+        }
+
+        if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
+            if (st->in_string) {
+                // Likewise only the closing quote or an escape matter
+                char stops[2] = { st->in_string, '\\' };
+                int end = scanForBytes(s, i, cap, stops, 2);
+                editorLexPaint(L, i, end, HL_STRING);
+                i = end;
+                st->prev_sep = 1;
+                if (i == cap) continue;
+                c = s[i];
+
+                if (c == '\\' && i + 1 < len) {
+                    editorLexPaint(L, i, i + 2, HL_STRING);
+                    i += 2;
+                    continue;
+                }
+                editorLexPaint(L, i, i + 1, HL_STRING);
+                if ((unsigned char)c == st->in_string) st->in_string = 0;
+                i++;
+                continue;
+            } else {
+                if (c == '"' || c == '\'') {
+                    st->in_string = c;
+                    editorLexPaint(L, i, i + 1, HL_STRING);
+                    i++;
+                    continue;
+                }
+            }
+        }
+
+        if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+            if ((isdigit((unsigned char)c) &&
+                 (st->prev_sep || prev_hl == HL_NUMBER)) ||
+                (c == '.' && prev_hl == HL_NUMBER)) {
+                editorLexPaint(L, i, i + 1, HL_NUMBER);
+                i++;
+                st->prev_sep = 0;
+                continue;
+            }
+        }
+
+        if (st->prev_sep) {
+            // A keyword has to fill the whole run up to the next
+            // separator; anything longer than every keyword isn't one
+            int klen = 0;
+            while (i + klen < len && klen <= kwMax && !is_separator(s[i + klen]))
+                klen++;
+
+            int kw = editorKeywordLookup(&s[i], klen);
+            if (kw != HL_NORMAL) {
+                editorLexPaint(L, i, i + klen, kw);
+                i += klen;
+                st->prev_sep = 0;
+                continue;
+            }
+        }
+
+        st->prev_sep = is_separator(c);
+        editorLexPaint(L, i, i + 1, HL_NORMAL);
+        i++;
+
+        if (!st->prev_sep) {
+            // The rest of a word that wasn't a keyword stays plain
+            int word = i;
+            while (i < cap) {
+                c = s[i];
+                if (is_separator(c) || c == '"' || c == '\'' ||
+                    (scs_len && c == scs[0]) || (mcs_len && c == mcs[0]))
+                    break;
+                i++;
+            }
+            editorLexPaint(L, word, i, HL_NORMAL);
+        }
+    }
+    return i;
+}
+
+int editorHighlightFrom(erow *row, unsigned char *hl, int from, int to,
+                        int in_comment, int stop) {
+    /*
+    Highlights render into hl, one byte per column, from column `from`, which has to be the start of
+    the row or just after a plain separator, where the lexer carries
+    no state but in_comment, up to column `to`. hl only has to hold
+    [from - 1, to). If stop is not negative, the hl already
+    past stop is what the same text highlighted to before an edit, and
+    lexing ends at the first plain separator past stop that was plain
+    before as well: from there on both runs agree. Returns the column
+    it stopped at; at the end of the row it sets hl_open_comment.
+    */
+    if (E.syntax == NULL) return row->rSize;
+
+    struct lexer L = {0};
+    L.s = editorRowView(row, from);
+    L.len = row->rSize;
+    L.hl = hl;
+    L.hlEnd = to;
+    L.end = to;
+    L.stop = stop;
+    L.st.in_comment = in_comment;
+    L.st.prev_sep = 1;
+    L.st.prev_hl = from > 0 ? hl[from - 1] : HL_NORMAL;
+
+    int at = editorLex(&L, from);
+    if (at >= row->rSize) row->hl_open_comment = L.st.in_comment;
+    return at;
+}
+
+int editorSyntaxLookahead(void) {
+    // How far past a char the lexer may look to classify it
+    if (E.syntax == NULL) return 0;
+    char *scs = E.syntax->singleline_comment_start;
+    char *mcs = E.syntax->multiline_comment_start;
+    int scs_len = scs ? strlen(scs) : 0;
+    int mcs_len = mcs ? strlen(mcs) : 0;
+    int len = scs_len > mcs_len ? scs_len : mcs_len;
+    return len > 1 ? len - 1 : 0;
+}
+
+unsigned char *editorHlBuffer(int len) {
+    // Scratch room for len columns of hl, reused from row to row
+    if (E.hlBufCap < len + 1) {
+        E.hlBufCap = len + 1;
+        E.hlBuf = realloc(E.hlBuf, E.hlBufCap);
+        if (E.hlBuf == NULL) die("realloc");
+    }
+    return E.hlBuf;
+}
+
+void editorRowSetHl(erow *row, const unsigned char *hl, int len) {
+    // Stores hl[0, len) as the row's spans
+    int n = 0;
+    for (int i = 0; i < len; i++)
+        if (hl[i] != HL_NORMAL && (i == 0 || hl[i - 1] != hl[i])) n++;
+
+    // Allocated even when empty: hl being set is what marks a row done
+    row->hl = realloc(row->hl, sizeof(struct hlSpan) * (n ? n : 1));
+    if (row->hl == NULL) die("realloc");
+    row->nHl = n;
+
+    n = 0;
+    for (int i = 0; i < len; ) {
+        int end = i + 1;
+        while (end < len && hl[end] == hl[i]) end++;
+        if (hl[i] != HL_NORMAL) {
+            row->hl[n].start = i;
+            row->hl[n].len = end - i;
+            row->hl[n].hl = hl[i];
+            n++;
+        }
+        i = end;
+    }
+}
+
+int editorRowSpanAt(erow *row, int rx) {
+    // Index of the first span that ends past column rx
+    int lo = 0;
+    int hi = row->nHl;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (row->hl[mid].start + row->hl[mid].len <= rx) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+void editorRowExpandHl(erow *row, unsigned char *hl, int from, int to,
+                       int shift) {
+    // Writes the spans over columns [from, to) out as one byte per
+    // column, at hl[from + shift, to + shift)
+    memset(&hl[from + shift], HL_NORMAL, to - from);
+    for (int k = editorRowSpanAt(row, from); k < row->nHl; k++) {
+        struct hlSpan *sp = &row->hl[k];
+        if (sp->start >= to) break;
+        int lo = sp->start > from ? sp->start : from;
+        int hi = sp->start + sp->len < to ? sp->start + sp->len : to;
+        memset(&hl[lo + shift], sp->hl, hi - lo);
+    }
+}
+
+void editorRowSpliceHl(erow *row, const unsigned char *hl, int from, int to,
+                       int shift) {
+    /*
+    Replaces the spans over columns [from, to) with hl[from, to). The
+    spans past that are in columns from before an edit that moved them
+    by shift, which they are moved by. Only the spans around the
+    window are rebuilt; the rest are kept or moved as they are.
+    */
+    int a = editorRowSpanAt(row, from);
+    int b = editorRowSpanAt(row, to - shift);
+
+    int n = 0;
+    for (int i = from; i < to; i++)
+        if (hl[i] != HL_NORMAL && (i == from || hl[i - 1] != hl[i])) n++;
+
+    // Spans cut by either end of the window keep their outside part
+    struct hlSpan *mid = malloc(sizeof(struct hlSpan) * (n + 2));
+    if (mid == NULL) die("malloc");
+    int nMid = 0;
+    if (a < row->nHl && row->hl[a].start < from) {
+        mid[nMid] = row->hl[a];
+        mid[nMid].len = from - row->hl[a].start;
+        nMid++;
+    }
+    for (int i = from; i < to; ) {
+        int end = i + 1;
+        while (end < to && hl[end] == hl[i]) end++;
+        if (hl[i] != HL_NORMAL) {
+            if (nMid && mid[nMid - 1].hl == hl[i] &&
+                mid[nMid - 1].start + mid[nMid - 1].len == i) {
+                mid[nMid - 1].len += end - i;
+            } else {
+                mid[nMid].start = i;
+                mid[nMid].len = end - i;
+                mid[nMid].hl = hl[i];
+                nMid++;
+            }
+        }
+        i = end;
+    }
+    if (b < row->nHl && row->hl[b].start < to - shift) {
+        struct hlSpan *sp = &row->hl[b];
+        int end = sp->start + sp->len + shift;
+        if (nMid && mid[nMid - 1].hl == sp->hl &&
+            mid[nMid - 1].start + mid[nMid - 1].len == to) {
+            mid[nMid - 1].len = end - mid[nMid - 1].start;
+        } else {
+            mid[nMid].start = to;
+            mid[nMid].len = end - to;
+            mid[nMid].hl = sp->hl;
+            nMid++;
+        }
+        b++;
+    }
+
+    // Where the window's first and last spans run into their neighbours
+    int head = a;
+    int m = 0;
+    if (nMid && head > 0 && row->hl[head - 1].hl == mid[0].hl &&
+        row->hl[head - 1].start + row->hl[head - 1].len == mid[0].start) {
+        row->hl[head - 1].len += mid[0].len;
+        m = 1;
+    }
+    int tail = row->nHl - b;
+    int join = 0;
+    struct hlSpan *last = nMid > m ? &mid[nMid - 1] : m ? &row->hl[head - 1] : NULL;
+    if (last && tail && row->hl[b].hl == last->hl &&
+        last->start + last->len == row->hl[b].start + shift) {
+        last->len += row->hl[b].len;
+        join = 1;
+    }
+
+    int nHl = head + (nMid - m) + tail - join;
+    if (nHl > row->nHl) {
+        row->hl = realloc(row->hl, sizeof(struct hlSpan) * nHl);
+        if (row->hl == NULL) die("realloc");
+    }
+    memmove(&row->hl[head + nMid - m], &row->hl[b + join],
+            sizeof(struct hlSpan) * (tail - join));
+    memcpy(&row->hl[head], &mid[m], sizeof(struct hlSpan) * (nMid - m));
+    free(mid);
+    if (shift) {
+        for (int k = head + nMid - m; k < nHl; k++) row->hl[k].start += shift;
+    }
+    row->nHl = nHl;
+}
+
+void editorUpdateSyntax(erow *row, int in_comment) {
+    /*
+    Highlights render, given whether the row starts inside a multi-line
+    comment, and records whether it ends inside one.
+    */
+    unsigned char *hl = editorHlBuffer(row->rSize);
+    memset(hl, HL_NORMAL, row->rSize);
+
+    if (in_comment) row->flags |= ROW_HL_IN_COMMENT;
+    else row->flags &= ~ROW_HL_IN_COMMENT;
+    row->hl_open_comment = 0;
+
+    editorHighlightFrom(row, hl, 0, row->rSize, in_comment, -1);
+    editorRowSetHl(row, hl, row->rSize);
+}
+
+int editorSyntaxState(erow *row, int in_comment) {
+    /*
+    Works out whether a row ends inside a multi-line comment without
+    rendering or highlighting it. Only strings and comments can change
+    that, so this follows the same rules as editorUpdateSyntax() for
+    those and jumps between the few bytes that can start or end one.
+    Tabs don't matter here, so it reads chars directly.
+    */
+    if (E.syntax == NULL) return 0;
+
+    char *scs = E.syntax->singleline_comment_start;
+    char *mcs = E.syntax->multiline_comment_start;
+    char *mce = E.syntax->multiline_comment_end;
+
+    int scs_len = scs ? strlen(scs) : 0;
+    int mcs_len = mcs ? strlen(mcs) : 0;
+    int mce_len = mce ? strlen(mce) : 0;
+    int strings = E.syntax->flags & HL_HIGHLIGHT_STRINGS;
+    if (!mce_len) mcs_len = 0;
+
+    // Bytes that can change state outside of strings and comments
+    char plain[4];
+    int nPlain = 0;
+    if (strings) {
+        plain[nPlain++] = '"';
+        plain[nPlain++] = '\'';
+    }
+    if (scs_len) plain[nPlain++] = scs[0];
+    if (mcs_len) plain[nPlain++] = mcs[0];
+
+    char *s = editorRowChars(row);
+    int size = row->size;
+    int in_string = 0;
+    int i = 0;
+    while (i < size) {
+        if (in_comment) {
+            i = scanForBytes(s, i, size, mce, 1);
+            if (i == size) break;
+            if (size - i >= mce_len && !strncmp(&s[i], mce, mce_len)) {
+                i += mce_len;
+                in_comment = 0;
+            } else {
+                i++;
+            }
+            continue;
+        }
+
+        if (in_string) {
+            char stops[2] = { in_string, '\\' };
+            i = scanForBytes(s, i, size, stops, 2);
+            if (i == size) break;
+            if (s[i] == '\\') {
+                i += 2;
+            } else {
+                in_string = 0;
+                i++;
+            }
+            continue;
+        }
+
+        i = scanForBytes(s, i, size, plain, nPlain);
+        if (i == size) break;
+
+        if (scs_len && size - i >= scs_len && !strncmp(&s[i], scs, scs_len))
+            break;
+        if (mcs_len && size - i >= mcs_len && !strncmp(&s[i], mcs, mcs_len)) {
+            i += mcs_len;
+            in_comment = 1;
+            continue;
+        }
+        if (strings && (s[i] == '"' || s[i] == '\'')) in_string = s[i];
+        i++;
+    }
+    return in_comment;
+}
+
+void editorInvalidateSyntax(int at) {
+    // Row `at` changed, so its state and everything after it is suspect
+    if (at < E.syntaxStale) E.syntaxStale = at;
+    if (at > E.syntaxStaleEnd) E.syntaxStaleEnd = at;
+    editorQueueIdle(editorSyntaxIdle);
+}
+
+int editorSyntaxCatchUp(int upto, long budget) {
+    /*
+    Brings hl_open_comment up to date for every row up to `upto`,
+    starting from the first stale row. Rows whose hl is still valid
+    for their incoming state are reused, the rest only get a state
+    scan. Nothing past `upto` is touched unless the scan can prove
+    the rest of the file is already consistent.
+
+    This is a loop rather than a chain of calls, so a comment opened
+    at the top of a huge file can't blow the stack. It stops after
+    scanning `budget` bytes (no limit if negative) and returns whether
+    it got all the way to `upto`; the next call resumes where it left
+    off.
+    */
+    if (upto >= E.numRows) upto = E.numRows - 1;
+    if (E.syntaxStale > upto) return 1;
+
+    int at = E.syntaxStale;
+    erow *prev = editorRowAt(at - 1);
+    int in = prev ? prev->hl_open_comment : 0;
+
+    rowIter it;
+    erow *row = rowIterSeek(&it, at);
+    while (at <= upto) {
+        if (budget >= 0 && budget-- <= 0) break;
+
+        int out;
+        if ((row->hl || row->chunks) &&
+            !!(row->flags & ROW_HL_IN_COMMENT) == in) {
+            out = row->hl_open_comment;
+        } else {
+            // hl no longer matches how the row starts
+            free(row->hl);
+            row->hl = NULL;
+            row->nHl = 0;
+            if (row->chunks) editorRowDropChunks(row);
+            out = editorSyntaxState(row, in);
+            if (budget > 0) budget -= row->size;
+        }
+
+        int changed = (out != row->hl_open_comment);
+        row->hl_open_comment = out;
+        at++;
+        if (!changed && at > E.syntaxStaleEnd) {
+            at = E.numRows;
+            break;
+        }
+        in = out;
+        row = rowIterNext(&it);
+    }
+
+    E.syntaxStale = at;
+    if (E.syntaxStale >= E.numRows) E.syntaxStaleEnd = -1;
+    return at > upto;
+}
+
+int editorSyntaxIdle(void) {
+    /*
+    Runs one bounded slice of catching up on rows past the screen.
+    Returns whether there is still stale state left to redo.
+    */
+    editorSyntaxCatchUp(E.numRows - 1, KILO_SYNTAX_BUDGET);
+    return E.syntaxStale < E.numRows;
+}
+
+void editorInvalidateAllSyntax(void) {
+    // Drops every row's highlighting, e.g. after the filetype changed
+    rowIter it;
+    for (erow *row = rowIterSeek(&it, 0); row; row = rowIterNext(&it)) {
+        free(row->hl);
+        row->hl = NULL;
+        row->nHl = 0;
+        if (row->chunks) editorRowDropChunks(row);
+    }
+    E.syntaxStale = 0;
+    E.syntaxStaleEnd = E.numRows - 1;
+    editorQueueIdle(editorSyntaxIdle);
+}
+
+int editorSyntaxToColor(int hl) {
+    switch (hl) {
+        case HL_COMMENT:
+        case HL_MLCOMMENT: return 32;
+        case HL_STRING: return 35;
+        case HL_MATCH: return 34;
+        case HL_KEYWORD1: return 33;
+        case HL_KEYWORD2: return 36;
+        case HL_NUMBER: return 31;
+        default: return 37;
+    }
+}
+
+void editorSelectSyntaxHighlight(void) {
+    E.syntax = NULL;
+    if (E.fileName == NULL) return;
+
+    char *ext = strrchr(E.fileName , '.');
+
+    for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
+        struct editorSyntax *s = &HLDB[j];
+        unsigned int i = 0;
+        while (s->filematch[i]) {
+            int is_ext = (s->filematch[i][0] == '.');
+            if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+                    (!is_ext && strstr(E.fileName, s->filematch[i]))) {
+                E.syntax = s;
+                if (s->kwTable == NULL) editorBuildKeywordTable(s);
+
+                /* Rows are re-highlighted lazily, the next time they
+                   are drawn or searched, rather than all at once here.
+                */
+                editorInvalidateAllSyntax();
+
+                return; 
+            }
+            i++;
+        }
+    }
+}
+
+/*** Row Operations ***/
+
+char *editorRowChars(erow *row) {
+    // Returns row's chars as one run, closing the gap if it has one
+    if (row == E.gap.row) {
+        memmove(&row->chars[E.gap.at], &row->chars[E.gap.at + E.gap.len],
+                row->size - E.gap.at);
+        row->chars[row->size] = '\0';
+        E.gap.row = NULL;
+    }
+    return row->chars;
+}
+
+int editorRenderSpan(int rx, const char *s, int len, char *render) {
+    /*
+    Renders len chars starting at column rx into render, if it isn't
+    NULL, and returns the column they end at.
+    */
+    if (render == NULL) {
+        // Runs between tabs are one column per char, so jump tab to tab
+        const char *end = s + len;
+        while (s < end) {
+            const char *tab = memchr(s, '\t', end - s);
+            if (tab == NULL) return rx + (end - s);
+            rx += tab - s;
+            rx += KILO_TAB_STOP - rx % KILO_TAB_STOP;
+            s = tab + 1;
+        }
+        return rx;
+    }
+
+    for (int j = 0; j < len; j++) {
+        if (s[j] == '\t') {
+            render[rx++] = ' ';
+            // Add spaces until you hit a column divisible by 8 (tab stop)
+            while (rx % KILO_TAB_STOP != 0) render[rx++] = ' ';
+        } else {
+            render[rx++] = s[j];
+        }
+    }
+    return rx;
+}
+
+void editorRowIndexTabs(erow *row) {
+    /*
+    Records where each tab of the row is and the column it ends at.
+    Between two tabs cx and rx move together, so that is all it takes
+    to convert between them.
+    */
+    if (row->flags & ROW_INDEXED) return;
+
+    char *chars = editorRowChars(row);
+    struct tabStop *tabs = NULL;
+    int n = 0;
+    int cap = 0;
+    int rx = 0;
+    int j = 0;
+    while (j < row->size) {
+        char *tab = memchr(&chars[j], '\t', row->size - j);
+        if (tab == NULL) break;
+        rx += tab - &chars[j];
+        rx += KILO_TAB_STOP - rx % KILO_TAB_STOP;
+        j = tab - chars + 1;
+
+        if (n == cap) {
+            cap = cap ? cap * 2 : 8;
+            tabs = realloc(tabs, sizeof(struct tabStop) * cap);
+            if (tabs == NULL) die("realloc");
+        }
+        tabs[n].cx = j - 1;
+        tabs[n].rx = rx;
+        n++;
+    }
+
+    free(row->tabs);
+    row->tabs = tabs;
+    row->nTabs = n;
+    row->rSize = rx + row->size - j;
+    row->flags |= ROW_INDEXED;
+}
+
+int editorRowTabAt(erow *row, int cx) {
+    // Number of tabs before char cx
+    int lo = 0;
+    int hi = row->nTabs;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (row->tabs[mid].cx < cx) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+int editorRowCxToRx(erow *row, int cx) {
+    if (row->chunks) {
+        // Long rows walk the chunk holding cx. While typing the gap
+        // sits at the cursor, so the text before cx reads as it is.
+        struct rowChunk *c = &row->chunks->c[editorChunkAt(row->chunks, cx, 0)];
+        return editorRenderSpan(c->rx, editorRowSpan(row, c->cx, cx),
+                                cx - c->cx, NULL);
+    }
+
+    editorRowIndexTabs(row);
+    int k = editorRowTabAt(row, cx);
+    if (k == 0) return cx;
+    return row->tabs[k - 1].rx + cx - row->tabs[k - 1].cx - 1;
+}
+
+int editorRowRxToCx(erow *row, int rx) {
+    // Returns the char that covers column rx
+    if (row->chunks) {
+        struct rowChunks *ch = row->chunks;
+        int k = editorChunkAt(ch, rx, 1);
+        int cur_rx = ch->c[k].rx;
+        int from = ch->c[k].cx;
+        int to = editorChunkEnd(row, k);
+
+        char *chars = editorRowSpan(row, from, to);
+        int cx;
+        for (cx = from; cx < to; cx++) {
+            if (chars[cx - from] == '\t')
+                cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
+            cur_rx++;
+
+            if (cur_rx > rx) return cx;
+        }
+        return cx;
+    }
+
+    editorRowIndexTabs(row);
+    // Last tab that ends at or before rx
+    int lo = 0;
+    int hi = row->nTabs;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (row->tabs[mid].rx <= rx) lo = mid + 1;
+        else hi = mid;
+    }
+    int cx = rx;
+    if (lo > 0) cx = row->tabs[lo - 1].cx + 1 + rx - row->tabs[lo - 1].rx;
+    if (lo < row->nTabs && cx > row->tabs[lo].cx) cx = row->tabs[lo].cx;
+    if (cx > row->size) cx = row->size;
+    return cx;
+}
+
+int editorTabSpan(const char *s, int len) {
+    // Length of s up to and including its first tab
+    const char *tab = memchr(s, '\t', len);
+    return tab ? tab - s + 1 : len;
+}
+
+void editorRowRender(erow *row) {
+    /*
+    Characters in chars are transferred to and then formatted
+    in render. Render takes inputs and puts them into a universal
+    format on all OS. Rows without tabs would render to a copy of
+    chars, so they are left as they are; see editorRowView().
+    */
+    editorRowIndexTabs(row);
+    if (row->render || row->nTabs == 0) return;
+
+    char *chars = editorRowChars(row);
+    row->render = malloc(row->rSize + 1);
+    editorRenderSpan(0, chars, row->size, row->render);
+    row->render[row->rSize] = '\0';
+}
+
+const char *editorRowView(erow *row, int from) {
+    /*
+    What the row renders to, readable from column `from` to rSize:
+    render, or the chars of a row that has none. Those only need the
+    gap moved out of the way, which is cheap when `from` is near it.
+    */
+    if (row->render) return row->render;
+    return editorRowSpan(row, from, row->size) - from;
+}
+
+char editorRowCharAt(erow *row, int at) {
+    // chars[at], wherever the gap is
+    if (row == E.gap.row && at >= E.gap.at) at += E.gap.len;
+    return row->chars[at];
+}
+
+void editorRowCopy(erow *row, int from, int to, char *dst) {
+    // Copies chars [from, to) to dst, reading either side of the gap
+    // rather than moving it
+    int split = row == E.gap.row ? E.gap.at : to;
+    if (split < from) split = from;
+    if (split > to) split = to;
+    memcpy(dst, &row->chars[from], split - from);
+    if (split < to)
+        memcpy(&dst[split - from], &row->chars[split + E.gap.len], to - split);
+}
+
+erow *editorRowHighlight(int at) {
+    /*
+    Returns row `at` with render and hl built and up to date. Only rows
+    that are drawn or searched ever get here.
+    */
+    erow *row = editorRowAt(at);
+    if (row == NULL) return NULL;
+
+    // Rows that are drawn always get correct state, however far the
+    // stale region reaches
+    editorSyntaxCatchUp(at, -1);
+    erow *prev = editorRowAt(at - 1);
+    int in = prev ? prev->hl_open_comment : 0;
+
+    if (row->size > KILO_LONG_ROW) {
+        // Only the part of a long row on screen is rendered
+        if (row->chunks == NULL || !!(row->flags & ROW_HL_IN_COMMENT) != in)
+            editorRowBuildChunks(row, in);
+        editorRowWindow(row, E.colOff, E.colOff + E.screenCols);
+        return row;
+    }
+    if (row->chunks) editorRowDropChunks(row);
+
+    editorRowRender(row);
+    if (row->hl == NULL || !!(row->flags & ROW_HL_IN_COMMENT) != in)
+        editorUpdateSyntax(row, in);
+    return row;
+}
+
+void editorUpdateRow(erow *row) {
+    // chars changed: drop render and hl until the row is next needed
+    editorRowDropChunks(row);
+    editorInvalidateSyntax(editorRowIndex(row));
+    editorFindRowEdited(row);
+}
+
+erow *editorInsertRowChars(int at, size_t len) {
+    /*
+    Adds a row with room for len chars and returns it for the caller
+    to fill in. A short row keeps its chars in the spare bytes at the
+    end of its own record, so it costs a single block from the pool.
+    */
+    erow *row = poolAlloc(ROW_RECORD);
+    size_t inl = poolSize(ROW_RECORD) - sizeof(erow);
+
+    row->size = len;
+    if (len < inl) {
+        row->chars = (char *)(row + 1);
+        row->cap = inl;
+        row->flags = ROW_INLINE;
+    } else {
+        row->cap = poolSize(len + 1);
+        row->chars = poolAlloc(row->cap);
+        row->flags = 0;
+    }
+    row->chars[len] = '\0';
+
+    row->rSize = 0;
+    row->render = NULL;
+    row->hl = NULL;
+    row->nHl = 0;
+    row->hl_open_comment = 0;
+    row->snap = 0;
+    row->chunks = NULL;
+    row->tabs = NULL;
+    row->nTabs = 0;
+
+    rowTreeInsert(at, row);
+    E.numRows++;
+    if (E.syntaxStaleEnd >= at) E.syntaxStaleEnd++;
+    editorInvalidateSyntax(at);
+    // The row pushed down to at + 1 now follows a different row
+    if (E.syntaxStaleEnd < at + 1) E.syntaxStaleEnd = at + 1;
+    editorFindRowsMoved(at, 1);
+
+    E.dirty++;
+    return row;
+}
+
+void editorInsertRow(int at, char *s, size_t len) {
+    if (at < 0 || at > E.numRows) return;
+
+    memcpy(editorInsertRowChars(at, len)->chars, s, len);
+}
+
+int editorRowShared(erow *row) {
+    // Whether a background save is still writing this row's chars
+    return E.save.active && row->snap == E.save.gen;
+}
+
+void editorOrphan(void *p, size_t size) {
+    // Keeps a buffer the save still needs until the save is over
+    struct saveJob *job = &E.save;
+    if (job->nOrphans == job->orphanCap) {
+        job->orphanCap = job->orphanCap ? job->orphanCap * 2 : 64;
+        job->orphans = realloc(job->orphans,
+                               sizeof(struct poolBlock) * job->orphanCap);
+        if (job->orphans == NULL) die("realloc");
+    }
+    job->orphans[job->nOrphans].p = p;
+    job->orphans[job->nOrphans].size = size;
+    job->nOrphans++;
+}
+
+void editorRowReleaseChars(erow *row) {
+    // Gives back row's own buffer, or leaves it to the save reading it
+    if (row->flags & (ROW_MAPPED | ROW_INLINE)) return;
+    if (editorRowShared(row)) editorOrphan(row->chars, row->cap);
+    else poolFree(row->chars, row->cap);
+}
+
+void editorRowMove(erow *row, size_t need) {
+    /*
+    Moves row's chars, gap and all, to a buffer of its own that holds
+    at least need bytes. Buffers come in size classes, so a short row
+    grows a class at a time rather than a byte at a time.
+    */
+    size_t cap = poolSize(need);
+    char *chars = poolAlloc(cap);
+    size_t keep = row->flags & ROW_MAPPED ? (size_t)row->size : (size_t)row->cap;
+    memcpy(chars, row->chars, keep < cap ? keep : cap);
+    editorRowReleaseChars(row);
+    row->chars = chars;
+    row->cap = cap;
+    row->flags &= ~(ROW_MAPPED | ROW_INLINE);
+}
+
+void editorRowReserve(erow *row, size_t need) {
+    /*
+    Makes row's chars a NUL-terminated buffer of its own with room for
+    need bytes. Copy on write: a mapped row gets its own buffer on its
+    first edit, and so does a row whose buffer a save is writing out.
+    */
+    editorRowChars(row);
+    if (need < (size_t)row->size + 1) need = row->size + 1;
+    if (!(row->flags & ROW_MAPPED) && !editorRowShared(row) &&
+        (size_t)row->cap >= need) return;
+
+    editorRowMove(row, need);
+    row->chars[row->size] = '\0';
+    row->snap = 0;
+}
+
+void editorRowDetach(erow *row) {
+    editorRowReserve(row, 0);
+}
+
+void editorFreeRow(erow *row) {
+    if (row == E.gap.row) E.gap.row = NULL;
+    editorRowDropChunks(row);
+    editorRowReleaseChars(row);
+}
+
+void editorDelRow(int at) {
+    if (at < 0 || at >= E.numRows) return;
+    erow *row = rowTreeRemove(at);
+    E.numRows--;
+    // The row that moves up into `at` now follows a different row
+    if (E.syntaxStaleEnd > at) E.syntaxStaleEnd--;
+    editorInvalidateSyntax(at);
+    editorFindRowsMoved(at, -1);
+    editorFreeRow(row);
+    // Rows from the block built by editorLoadRows() go away with it. A
+    // save may still be reading chars kept inside the record.
+    if (!(row->flags & ROW_BLOCK)) {
+        if (E.save.active) editorOrphan(row, ROW_RECORD);
+        else poolFree(row, ROW_RECORD);
+    }
+    E.dirty++;
+}
+
+void editorRowPatch(erow *row, int rx, int segFrom, int oldEnd,
+                    const char *head, int headLen, const char *seg, int segLen) {
+    /*
+    After an edit, replaces render[rx, oldEnd) with the rendering of
+    head followed by seg, which used to start at column segFrom. seg
+    runs to the first tab after the edit or the end of the row; up to
+    that tab it renders the same, only moved, and past it every column
+    has moved by a whole tab stop, so the rest of render and hl only
+    shift. hl is then redone from the nearest point before rx where
+    the lexer had no state, up to where it agrees with what was there
+    before. A row without render has already changed, as its chars are
+    its render.
+
+    The lexer works on a window of columns past head, widened only if
+    it runs off the end of it before agreeing, and only the spans over
+    what it relexed are replaced, so a keystroke costs what it relexes
+    rather than the whole row.
+    */
+    int mid = editorRenderSpan(rx, head, headLen, NULL);
+    int newEnd = editorRenderSpan(mid, seg, segLen, NULL);
+    int shift = newEnd - oldEnd;
+    int rSize = row->rSize + shift;
+    int segTab = segLen > 0 && seg[segLen - 1] == '\t';
+    // Columns of seg before its tab, and the hl the tab had
+    int text = segLen - segTab;
+    int segShift = mid - segFrom;
+    int tabHl = HL_NORMAL;
+    if (segTab) {
+        int k = editorRowSpanAt(row, oldEnd - 1);
+        if (k < row->nHl && row->hl[k].start < oldEnd) tabHl = row->hl[k].hl;
+    }
+
+    if (row->render) {
+        if (newEnd > oldEnd) row->render = realloc(row->render, rSize + 1);
+        memmove(&row->render[newEnd], &row->render[oldEnd],
+                row->rSize - oldEnd + 1);
+        editorRenderSpan(rx, head, headLen, row->render);
+        editorRenderSpan(mid, seg, segLen, row->render);
+    }
+    row->rSize = rSize;
+    // Without a filetype there are no spans to patch
+    if (E.syntax == NULL) return;
+
+    // Restart before the last step that could have looked at the edit.
+    // No span covers a plain separator, so a span is skipped whole.
+    int from = rx - editorSyntaxLookahead();
+    if (from < 0) from = 0;
+    while (from > 0) {
+        int k = editorRowSpanAt(row, from - 1);
+        if (k < row->nHl && row->hl[k].start < from) {
+            from = row->hl[k].start;
+            continue;
+        }
+        // Plain columns run back to the end of the span before
+        int floor = k > 0 ? row->hl[k - 1].start + row->hl[k - 1].len : 0;
+        while (from > floor) {
+            char c = row->render ? row->render[from - 1] : editorRowCharAt(row, from - 1);
+            if (is_separator(c)) break;
+            from--;
+        }
+        if (from > floor) break;
+    }
+    int lo = from > 0 ? from - 1 : 0;
+    int in = from == 0 ? !!(row->flags & ROW_HL_IN_COMMENT) : 0;
+    int out = row->hl_open_comment;
+
+    int at;
+    for (int win = KILO_CHUNK; ; win *= 4) {
+        int to = rSize - mid > win ? mid + win : rSize;
+        // Spans past seg's tab move by shift, those before it by
+        // segShift, so the window has to take in the tab
+        if (segTab && to < newEnd) to = newEnd;
+
+        // The old hl over the window, in the columns it has now
+        unsigned char *hl = editorHlBuffer(to - lo) - lo;
+        editorRowExpandHl(row, hl, lo, rx, 0);
+        memset(&hl[rx], HL_NORMAL, mid - rx);
+        int textEnd = mid + text < to ? mid + text : to;
+        editorRowExpandHl(row, hl, segFrom, textEnd - segShift, segShift);
+        if (segTab) {
+            memset(&hl[mid + text], tabHl, newEnd - mid - text);
+            editorRowExpandHl(row, hl, oldEnd, to - shift, shift);
+        }
+
+        at = editorHighlightFrom(row, hl, from, to, in, mid);
+        if (at < to || to == rSize) {
+            if (at > to) at = to;
+            // What it stopped short of inside seg is in hl as it was
+            if (segTab && at < newEnd) at = newEnd;
+            editorRowSpliceHl(row, hl, from, at, shift);
+            break;
+        }
+    }
+
+    if (at == rSize && row->hl_open_comment != out) {
+        // Rows below may now start in or out of a comment
+        editorInvalidateSyntax(editorRowIndex(row) + 1);
+    }
+}
+
+void editorRowTabsEdit(erow *row, int at, int delta, int tab) {
+    /*
+    Keeps the tab index right across a one char insert (delta 1) or
+    delete (delta -1) at `at`, tab saying whether that char was one.
+    Later tabs move by a char, and their columns change only up to the
+    first one that ends where it did before.
+    */
+    if (!(row->flags & ROW_INDEXED)) return;
+    int k = editorRowTabAt(row, at);
+    struct tabStop *tabs = row->tabs;
+
+    if (tab && delta < 0) {
+        memmove(&tabs[k], &tabs[k + 1], sizeof(struct tabStop) * (row->nTabs - k - 1));
+        row->nTabs--;
+    }
+    for (int j = k; j < row->nTabs; j++) tabs[j].cx += delta;
+    if (tab && delta > 0) {
+        tabs = realloc(tabs, sizeof(struct tabStop) * (row->nTabs + 1));
+        if (tabs == NULL) die("realloc");
+        memmove(&tabs[k + 1], &tabs[k], sizeof(struct tabStop) * (row->nTabs - k));
+        tabs[k].cx = at;
+        tabs[k].rx = -1;
+        row->tabs = tabs;
+        row->nTabs++;
+    }
+
+    for (int j = k; j < row->nTabs; j++) {
+        int rx = tabs[j].cx;
+        if (j > 0) rx = tabs[j - 1].rx + tabs[j].cx - tabs[j - 1].cx - 1;
+        rx += KILO_TAB_STOP - rx % KILO_TAB_STOP;
+        if (rx == tabs[j].rx) break;
+        tabs[j].rx = rx;
+    }
+}
+
+void editorRowOpenGap(erow *row, int at, int need) {
+    /*
+    Makes row the one with the gap, moves the gap to `at` and makes
+    sure it has room for `need` more chars. Typing at one place only
+    ever moves the gap by a char, so it costs nothing per key.
+    */
+    if (row != E.gap.row) {
+        if (E.gap.row) editorRowChars(E.gap.row);
+        editorRowDetach(row);
+        E.gap.row = row;
+        E.gap.at = row->size;
+        // Whatever the buffer has spare past the row is already a gap
+        E.gap.len = row->cap - row->size - 1;
+    }
+
+    if (E.gap.len < need) {
+        int len = E.gap.len + need + KILO_ROW_GAP + row->size / 4;
+        editorRowMove(row, row->size + len + 1);
+        len = row->cap - row->size - 1;
+        memmove(&row->chars[E.gap.at + len], &row->chars[E.gap.at + E.gap.len],
+                row->size - E.gap.at);
+        E.gap.len = len;
+    }
+
+    char *chars = row->chars;
+
+    if (at < E.gap.at)
+        memmove(&chars[at + E.gap.len], &chars[at], E.gap.at - at);
+    else
+        memmove(&chars[E.gap.at], &chars[E.gap.at + E.gap.len], at - E.gap.at);
+    E.gap.at = at;
+}
+
+void editorRowInsertChar(erow *row, int at, int c) {
+    // at is the index we want to insert character at
+    if (at < 0 || at > row->size) at = row->size;
+    editorRowOpenGap(row, at, 1);
+
+    // What follows up to the next tab is all that renders differently.
+    // A first tab gives the row a render buffer, so that is rebuilt.
+    int patch = row->hl && !row->chunks && (row->render || c != '\t');
+    int rx = 0, oldEnd = 0, segLen = 0;
+    const char *seg = &row->chars[at + E.gap.len];
+    if (patch) {
+        rx = editorRowCxToRx(row, at);
+        segLen = editorTabSpan(seg, row->size - at);
+        oldEnd = editorRenderSpan(rx, seg, segLen, NULL);
+    }
+
+    char ch = c;
+    row->chars[E.gap.at++] = ch;
+    E.gap.len--;
+    row->size++;
+
+    if (row->chunks) {
+        editorChunksEdit(row, at, 1);
+        editorFindCharsEdited(row, at, 1);
+    } else if (patch) {
+        editorRowPatch(row, rx, rx, oldEnd, &ch, 1, seg, segLen);
+        editorRowTabsEdit(row, at, 1, ch == '\t');
+        editorFindCharsEdited(row, at, 1);
+    } else {
+        editorUpdateRow(row);
+    }
+    E.dirty++;
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len) {
+    editorRowReserve(row, row->size + len + 1);
+    // memcpy copies s onto end of current row
+    memcpy(&row->chars[row->size], s, len);
+    row->size += len;
+    row->chars[row->size] = '\0';
+    editorUpdateRow(row);
+    E.dirty++;
+}
 
-    return cx;
+int editorRowSplice(erow *row, const struct findHit *hit, int n,
+                    const char *with, int wLen) {
+    /*
+    Replaces row's n matches, in order, with `with` in a single pass
+    into a new buffer, rather than an edit per byte. A match that
+    overlaps the one before it is left alone. Returns how many were
+    replaced. Marking the row's syntax stale is left to the caller,
+    which can do it once for a whole run of rows.
+    */
+    const char *old = editorRowChars(row);
+    int size = row->size;
+    int end = 0;
+    for (int k = 0; k < n; k++) {
+        if (hit[k].cx < end) continue;
+        size += wLen - hit[k].len;
+        end = hit[k].cx + hit[k].len;
+    }
+
+    size_t cap = poolSize(size + 1);
+    char *chars = poolAlloc(cap);
+    int done = 0;
+    int from = 0;
+    int at = 0;
+    for (int k = 0; k < n; k++) {
+        if (hit[k].cx < from) continue;
+        memcpy(&chars[at], &old[from], hit[k].cx - from);
+        at += hit[k].cx - from;
+        memcpy(&chars[at], with, wLen);
+        at += wLen;
+        from = hit[k].cx + hit[k].len;
+        done++;
+    }
+    memcpy(&chars[at], &old[from], row->size - from);
+    chars[size] = '\0';
+
+    editorRowReleaseChars(row);
+    row->chars = chars;
+    row->cap = cap;
+    row->size = size;
+    row->flags &= ~(ROW_MAPPED | ROW_INLINE);
+    row->snap = 0;
+    editorRowDropChunks(row);
+    E.dirty++;
+    return done;
 }
 
-void editorUpdateRow(erow *row) {
+void editorRowDeleteCharacter(erow *row, int at) {
+    if (at < 0 || at >= row->size) return;
+    editorRowOpenGap(row, at + 1, 0);
+
+    int patch = row->hl && !row->chunks;
+    int tab = row->chars[at] == '\t';
+    int rx = 0, segFrom = 0, oldEnd = 0, segLen = 0;
+    const char *seg = &row->chars[at + 1 + E.gap.len];
+    if (patch) {
+        rx = editorRowCxToRx(row, at);
+        segLen = editorTabSpan(seg, row->size - at - 1);
+        segFrom = editorRenderSpan(rx, &row->chars[at], 1, NULL);
+        oldEnd = editorRenderSpan(segFrom, seg, segLen, NULL);
+    }
+
+    // The deleted char just becomes part of the gap
+    E.gap.at--;
+    E.gap.len++;
+    row->size--;
+
+    if (row->chunks) {
+        editorChunksEdit(row, at, -1);
+        editorFindCharsEdited(row, at, -1);
+    } else if (patch) {
+        editorRowPatch(row, rx, segFrom, oldEnd, NULL, 0, seg, segLen);
+        editorRowTabsEdit(row, at, -1, tab);
+        editorFindCharsEdited(row, at, -1);
+    } else {
+        editorUpdateRow(row);
+    }
+    E.dirty++;
+}
+
+/*** Long Rows ***/
+
+char *editorRowSpan(erow *row, int from, int to) {
     /*
-    Characters in chars are transferred to and then formatted
-    in render. Render takes inputs and puts them into a universal
-    format on all OS.
+    Returns chars [from, to) of row as one run. If the row's gap is
+    inside the span it moves to whichever end is nearer rather than
+    closing, so reading a chunk of a long row costs a chunk.
     */
-    
-    int tabs = 0;
-    int j;
-    for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') tabs++;
+    if (row != E.gap.row) return &row->chars[from];
+    if (E.gap.at > from && E.gap.at < to)
+        editorRowOpenGap(row, E.gap.at - from < to - E.gap.at ? from : to, 0);
+    if (E.gap.at <= from) return &row->chars[from + E.gap.len];
+    return &row->chars[from];
+}
+
+int editorChunkAt(struct rowChunks *ch, int at, int byRx) {
+    // Last chunk starting at or before char `at`, or column `at` if byRx
+    int lo = 0;
+    int hi = ch->n - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if ((byRx ? ch->c[mid].rx : ch->c[mid].cx) <= at) lo = mid;
+        else hi = mid - 1;
     }
+    return lo;
+}
+
+int editorChunkEnd(erow *row, int k) {
+    struct rowChunks *ch = row->chunks;
+    return k + 1 < ch->n ? ch->c[k + 1].cx : row->size;
+}
+
+int editorChunkCols(erow *row, int k) {
+    // Column chunk k ends at, and whether it holds a tab on the way
+    struct rowChunk *c = &row->chunks->c[k];
+    int len = editorChunkEnd(row, k) - c->cx;
+    char *s = editorRowSpan(row, c->cx, c->cx + len);
+    c->hasTab = memchr(s, '\t', len) != NULL;
+    return editorRenderSpan(c->rx, s, len, NULL);
+}
 
+void editorRowDropRender(erow *row) {
     free(row->render);
-    // Tabs will take max of 8 spaces, and they already take 1
-    // So multiply # of tabs by 7 to allocate correct amount of memory
-    row->render = malloc(row->size + tabs*(KILO_TAB_STOP - 1) + 1);
+    free(row->hl);
+    free(row->tabs);
+    row->render = NULL;
+    row->hl = NULL;
+    row->nHl = 0;
+    row->tabs = NULL;
+    row->nTabs = 0;
+    row->rSize = 0;
+    row->flags &= ~ROW_INDEXED;
+}
 
-    int i = 0;
-    for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') {
-            row->render[i++] = ' ';
-            // Add spaces until you hit a column divisible by 8 (tab stop)
-            while (i % KILO_TAB_STOP != 0) row->render[i++] = ' ';
+void editorRowDropChunks(erow *row) {
+    // Drops everything built from chars: render, hl and any chunks
+    editorRowDropRender(row);
+    if (row->chunks) {
+        free(row->chunks->c);
+        free(row->chunks);
+        row->chunks = NULL;
+    }
+}
+
+void editorRowBuildChunks(erow *row, int in) {
+    /*
+    Cuts a long row into chunks and lexes it from end to end once, to
+    find the state each chunk starts in. After this only chunks near
+    an edit or on screen are ever lexed again.
+    */
+    char *chars = editorRowChars(row);
+    editorRowDropRender(row);
+
+    struct rowChunks *ch = row->chunks;
+    if (ch == NULL) {
+        ch = calloc(1, sizeof(struct rowChunks));
+        if (ch == NULL) die("calloc");
+        row->chunks = ch;
+    }
+    ch->n = row->size ? (row->size + KILO_CHUNK - 1) / KILO_CHUNK : 1;
+    if (ch->cap < ch->n) {
+        ch->cap = ch->n;
+        ch->c = realloc(ch->c, sizeof(struct rowChunk) * ch->cap);
+        if (ch->c == NULL) die("realloc");
+    }
+
+    for (int k = 0; k < ch->n; k++) {
+        ch->c[k].cx = k * KILO_CHUNK;
+        memset(&ch->c[k].lex, 0, sizeof(struct lexState));
+    }
+    int rx = 0;
+    for (int k = 0; k < ch->n; k++) {
+        ch->c[k].rx = rx;
+        rx = editorChunkCols(row, k);
+    }
+    ch->c[0].lex.in_comment = in;
+    ch->c[0].lex.prev_sep = 1;
+
+    if (in) row->flags |= ROW_HL_IN_COMMENT;
+    else row->flags &= ~ROW_HL_IN_COMMENT;
+    row->hl_open_comment = 0;
+    if (E.syntax == NULL) return;
+
+    struct lexer L = {0};
+    L.s = chars;
+    L.len = row->size;
+    L.end = row->size;
+    L.stop = -1;
+    L.st = ch->c[0].lex;
+    L.marks = &ch->c[1];
+    L.nMarks = ch->n - 1;
+    editorLex(&L, 0);
+    row->hl_open_comment = L.st.in_comment;
+}
+
+void editorRowWindow(erow *row, int from, int to) {
+    /*
+    Makes render and hl of a long row cover columns [from, to), by
+    rendering the chunks under them and lexing those from the state
+    recorded where the first one starts.
+    */
+    struct rowChunks *ch = row->chunks;
+    if (from < 0) from = 0;
+    if (to <= from) to = from + 1;
+    if (row->render && ch->rOff <= from &&
+        (ch->winEnd || ch->rOff + row->rSize >= to))
+        return;
+
+    int a = editorChunkAt(ch, from, 1);
+    int b = editorChunkAt(ch, to - 1, 1);
+    int cxFrom = ch->c[a].cx;
+    int cxTo = editorChunkEnd(row, b);
+    int lexTo = cxTo + KILO_LEX_MARGIN;
+    if (lexTo > row->size) lexTo = row->size;
+    const char *s = editorRowSpan(row, cxFrom, lexTo);
+    int n = cxTo - cxFrom;
+
+    // Highlight per char first, then spread it over each char's columns
+    unsigned char *hl = malloc(n + 1);
+    memset(hl, HL_NORMAL, n);
+    if (E.syntax) {
+        struct lexer L = {0};
+        L.s = s;
+        L.len = lexTo - cxFrom;
+        L.hl = hl;
+        L.hlEnd = n;
+        L.end = n;
+        L.stop = -1;
+        L.st = ch->c[a].lex;
+        editorLex(&L, 0);
+    }
+
+    int rOff = ch->c[a].rx;
+    int rSize = editorRenderSpan(rOff, s, n, NULL) - rOff;
+    editorRowDropRender(row);
+    row->render = malloc(rSize + 1);
+    unsigned char *cols = editorHlBuffer(rSize);
+    int rx = rOff;
+    for (int j = 0; j < n; j++) {
+        int w = 1;
+        if (s[j] == '\t') w = KILO_TAB_STOP - rx % KILO_TAB_STOP;
+        memset(&row->render[rx - rOff], s[j] == '\t' ? ' ' : s[j], w);
+        memset(&cols[rx - rOff], hl[j], w);
+        rx += w;
+    }
+    free(hl);
+    row->render[rSize] = '\0';
+    row->rSize = rSize;
+    editorRowSetHl(row, cols, rSize);
+    ch->rOff = rOff;
+    ch->winEnd = b + 1 == ch->n;
+}
+
+void editorChunkRemove(struct rowChunks *ch, int k) {
+    memmove(&ch->c[k], &ch->c[k + 1], sizeof(struct rowChunk) * (ch->n - k - 1));
+    ch->n--;
+}
+
+void editorChunkSplit(struct rowChunks *ch, int k, int cx) {
+    // Starts a new chunk at cx; the caller works out its rx and state
+    if (ch->n == ch->cap) {
+        ch->cap *= 2;
+        ch->c = realloc(ch->c, sizeof(struct rowChunk) * ch->cap);
+        if (ch->c == NULL) die("realloc");
+    }
+    memmove(&ch->c[k + 2], &ch->c[k + 1], sizeof(struct rowChunk) * (ch->n - k - 1));
+    ch->n++;
+    ch->c[k + 1].cx = cx;
+    // No real state looks like this, so relexing never stops here
+    memset(&ch->c[k + 1].lex, 0xff, sizeof(struct lexState));
+}
+
+void editorChunksEdit(erow *row, int at, int delta) {
+    /*
+    Follows a one char insert (delta 1) or delete (delta -1) at `at` in
+    a long row. Later chunks move along by a char; their columns move
+    too, until a tab takes up the shift. Then the lexer reruns from a
+    little before the edit, chunk by chunk, until it carries the same
+    state into a chunk as it did before.
+    */
+    struct rowChunks *ch = row->chunks;
+    // A char typed at a chunk boundary joins the chunk before it
+    int k = editorChunkAt(ch, delta > 0 && at > 0 ? at - 1 : at, 0);
+    for (int j = k + 1; j < ch->n; j++) ch->c[j].cx += delta;
+
+    if (ch->n > 1 && editorChunkEnd(row, k) == ch->c[k].cx) {
+        // Deleted the last char of a chunk
+        if (k == 0) {
+            editorChunkRemove(ch, 1);
+        } else {
+            editorChunkRemove(ch, k);
+            k--;
+        }
+    } else if (editorChunkEnd(row, k) - ch->c[k].cx >= 2 * KILO_CHUNK) {
+        editorChunkSplit(ch, k, ch->c[k].cx + KILO_CHUNK);
+    }
+
+    // Chunks k and k + 1 are measured again; past them a shift that
+    // isn't a whole tab stop only changes at the next tab
+    int shift = 0;
+    for (int j = k + 1; j < ch->n; j++) {
+        struct rowChunk *prev = &ch->c[j - 1];
+        if (j <= k + 2 || (shift % KILO_TAB_STOP && prev->hasTab)) {
+            int rx = editorChunkCols(row, j - 1);
+            shift = rx - ch->c[j].rx;
+            ch->c[j].rx = rx;
         } else {
-            row->render[i++] = row->chars[j];
+            ch->c[j].rx += shift;
         }
+        if (shift == 0 && j >= k + 2) break;
     }
-    row->render[i] = '\0';
-    row->rSize = i;
+    if (ch->n == k + 1 || ch->n == k + 2) editorChunkCols(row, ch->n - 1);
+    editorRowDropRender(row);
+    if (E.syntax == NULL) return;
+
+    // A chunk split off just now has no state to start from yet
+    int j = editorChunkAt(ch, at > KILO_LEX_MARGIN ? at - KILO_LEX_MARGIN : 0, 0);
+    if (j > k) j = k;
+    for (;;) {
+        struct rowChunk *c = &ch->c[j];
+        int end = editorChunkEnd(row, j);
+        int lexTo = end + KILO_LEX_MARGIN;
+        if (lexTo > row->size) lexTo = row->size;
+
+        struct lexer L = {0};
+        L.s = editorRowSpan(row, c->cx, lexTo);
+        L.len = lexTo - c->cx;
+        L.end = end - c->cx;
+        L.stop = -1;
+        L.st = c->lex;
+
+        if (j + 1 == ch->n) {
+            editorLex(&L, 0);
+            if (L.st.in_comment != row->hl_open_comment) {
+                // Rows below may now start in or out of a comment
+                row->hl_open_comment = L.st.in_comment;
+                editorInvalidateSyntax(editorRowIndex(row) + 1);
+            }
+            return;
+        }
 
-    editorUpdateSyntax(row);
+        struct lexState old = c[1].lex;
+        L.marks = &c[1];
+        L.nMarks = 1;
+        L.markBase = c->cx;
+        editorLex(&L, 0);
+        j++;
+        if (ch->c[j].cx > at && !memcmp(&old, &ch->c[j].lex, sizeof(old)))
+            return;
+    }
 }
 
-void editorInsertRow(int at, char *s, size_t len) {
-    if (at < 0 || at > E.numRows) return;
+/*** Editor Operations ***/
 
-    // Update rows
-    E.row = realloc(E.row, sizeof(erow) * (E.numRows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * E.numRows - at);
-    for (int j = at + 1; j <= E.numRows; j++) E.row[j].idx++;
+void editorInsertText(const char *s, size_t len) {
+    /*
+    Splices a block of text in at the cursor in one go. The current row
+    is split once, every complete line in between becomes a new row,
+    and the row after the cursor is rebuilt once, so a paste costs one
+    pass over its bytes no matter how many lines it has. Any of \r,
+    \n or \r\n ends a line.
+    */
+    static const char eol[] = { '\r', '\n' };
+    if (len == 0) return;
+    if (E.cy == E.numRows) editorInsertRow(E.numRows, "", 0);
+
+    erow *row = editorRowAt(E.cy);
+    int lineEnd = scanForBytes(s, 0, len, eol, 2);
+
+    if ((size_t)lineEnd == len) {
+        // A single line: at most one copy and a memmove
+        editorRowReserve(row, row->size + len + 1);
+        memmove(&row->chars[E.cx + len], &row->chars[E.cx],
+                row->size - E.cx + 1);
+        memcpy(&row->chars[E.cx], s, len);
+        row->size += len;
+        E.cx += len;
+        editorUpdateRow(row);
+        E.dirty++;
+        return;
+    }
 
-    E.row[at].idx = at;
+    // The text after the cursor moves to the end of the last line. The
+    // rows added in between move the matches below them just once.
+    editorFindBatch(1);
+    editorRowDetach(row);
+    size_t tailLen = row->size - E.cx;
+    char *tail = malloc(tailLen);
+    memcpy(tail, &row->chars[E.cx], tailLen);
+    row->size = E.cx;
+    row->chars[row->size] = '\0';
+    editorRowAppendString(row, (char *)s, lineEnd);
 
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len+1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+    size_t i = lineEnd;
+    int at = E.cy + 1;
+    while (1) {
+        if (s[i] == '\r' && i + 1 < len && s[i + 1] == '\n') i++;
+        i++;
+        int end = scanForBytes(s, i, len, eol, 2);
+        if ((size_t)end == len) break;
+        editorInsertRow(at++, (char *)&s[i], end - i);
+        i = end;
+    }
 
-    E.row[at].rSize = 0;
-    E.row[at].render = NULL;
-    E.row[at].hl = NULL;
-    E.row[at].hl_open_comment = 0;
-    editorUpdateRow(&E.row[at]);
+    char *last = editorInsertRowChars(at, len - i + tailLen)->chars;
+    memcpy(last, &s[i], len - i);
+    memcpy(&last[len - i], tail, tailLen);
+    free(tail);
+    editorFindBatch(0);
 
-    E.numRows++;
-    E.dirty++;
+    E.cy = at;
+    E.cx = len - i;
 }
 
-void editorFreeRow(erow *row) {
-    free(row->render);
-    free(row->chars);
-    free(row->hl);
+void editorInsertChar(int c) {
+    if (E.cy == E.numRows) {
+        editorInsertRow(E.numRows, "", 0);
+    }
+    editorRowInsertChar(editorRowAt(E.cy), E.cx, c);
+    E.cx++;
 }
 
-void editorDelRow(int at) {
-    if (at < 0 || at >= E.numRows) return;
-    editorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numRows - at - 1));
-    for (int j = at; j < E.numRows - 1; j++) E.row[j].idx--;
-    E.numRows--;
-    E.dirty++;
+void editorInsertNewLine(void) {
+    if (E.cx == 0) {
+        editorInsertRow(E.cy, "", 0);
+    } else {
+        erow *row = editorRowAt(E.cy);
+        editorInsertRow(E.cy + 1, &editorRowChars(row)[E.cx], row->size - E.cx);
+        // A mapped row just becomes a shorter view of the file, and a row
+        // being saved gets a copy of what is left
+        row->size = E.cx;
+        if (editorRowShared(row)) editorRowDetach(row);
+        else if (!(row->flags & ROW_MAPPED)) row->chars[row->size] = '\0';
+        editorUpdateRow(row);
+    }
+    E.cy++;
+    E.cx = 0;
 }
 
-void editorRowInsertChar(erow *row, int at, int c) {
-    // at is the index we want to insert character at
-    if (at < 0 || at > row->size) at = row->size;
-    // add 2 to make room for the null byte
-    row->chars = realloc(row->chars, row->size + 2);
-    // Copy row->size - at + 1 bytes
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
-    editorUpdateRow(row);
-    E.dirty++;
+void editorDeleteChar(void) {
+    if (E.cy == E.numRows) return;
+    if (E.cx == 0 && E.cy == 0) return;
+
+    erow *row = editorRowAt(E.cy);
+    if (E.cx > 0) {
+        editorRowDeleteCharacter(row, E.cx - 1);
+        E.cx--;
+    } else {
+        erow *prev = editorRowAt(E.cy - 1);
+        E.cx = prev->size;
+        // Prev row is 1st arg, curr row is 2nd and 3rd
+        editorRowAppendString(prev, editorRowChars(row), row->size);
+        editorDelRow(E.cy);
+        E.cy--;
+    }
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    // memcpy copies s onto end of current row
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    E.dirty++;
+/*** File I/O ***/
+
+struct lineScan {
+    // One thread's slice of the file and the newlines found in it
+    const char *buf;
+    size_t from, to;
+    size_t *pos;
+    size_t n, cap;
+};
+
+void *lineScanWorker(void *arg) {
+    struct lineScan *ls = arg;
+    size_t i = ls->from;
+
+    while (i < ls->to) {
+        unsigned int mask;
+        if (i + 16 <= ls->to) {
+            mask = byteMask16(&ls->buf[i], '\n');
+        } else {
+            mask = 0;
+            for (size_t j = i; j < ls->to; j++)
+                if (ls->buf[j] == '\n') mask |= 1u << (j - i);
+        }
+        while (mask) {
+            if (ls->n == ls->cap) {
+                ls->cap = ls->cap ? ls->cap * 2 : 4096;
+                ls->pos = realloc(ls->pos, sizeof(size_t) * ls->cap);
+                if (ls->pos == NULL) die("realloc");
+            }
+            ls->pos[ls->n++] = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+        i += 16;
+    }
+    return NULL;
+}
+
+size_t *editorIndexLines(const char *buf, size_t len, size_t *nNewlines) {
+    /*
+    Finds every newline in buf, splitting the scan across all cores.
+    Each thread collects the offsets in its slice and the slices are
+    then joined in order into one table.
+    */
+    long nThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nThreads < 1) nThreads = 1;
+    if (nThreads > KILO_MAX_THREADS) nThreads = KILO_MAX_THREADS;
+    if ((size_t)nThreads > len / KILO_SCAN_MIN_CHUNK)
+        nThreads = len / KILO_SCAN_MIN_CHUNK;
+    if (nThreads < 1) nThreads = 1;
+
+    struct lineScan scans[KILO_MAX_THREADS];
+    pthread_t threads[KILO_MAX_THREADS];
+    size_t chunk = len / nThreads;
+    for (long t = 0; t < nThreads; t++) {
+        scans[t].buf = buf;
+        scans[t].from = t * chunk;
+        scans[t].to = (t == nThreads - 1) ? len : (t + 1) * chunk;
+        scans[t].pos = NULL;
+        scans[t].n = scans[t].cap = 0;
+    }
+
+    long started = 1;
+    for (long t = 1; t < nThreads; t++, started++) {
+        if (pthread_create(&threads[t], NULL, lineScanWorker, &scans[t]) != 0)
+            break;
+    }
+    lineScanWorker(&scans[0]);
+    // Any slice whose thread failed to start is scanned here instead
+    for (long t = started; t < nThreads; t++) lineScanWorker(&scans[t]);
+    for (long t = 1; t < started; t++) pthread_join(threads[t], NULL);
+
+    size_t total = 0;
+    for (long t = 0; t < nThreads; t++) total += scans[t].n;
+
+    size_t *pos = malloc(sizeof(size_t) * (total + 1));
+    if (pos == NULL) die("malloc");
+    size_t n = 0;
+    for (long t = 0; t < nThreads; t++) {
+        memcpy(&pos[n], scans[t].pos, sizeof(size_t) * scans[t].n);
+        n += scans[t].n;
+        free(scans[t].pos);
+    }
+    *nNewlines = total;
+    return pos;
+}
+
+char *editorReadAll(int fd, size_t *len) {
+    // Reads a stream that can't be mapped in large blocks
+    size_t cap = KILO_READ_BLOCK;
+    char *buf = malloc(cap);
+    if (buf == NULL) die("malloc");
+    *len = 0;
+
+    ssize_t nread;
+    while ((nread = read(fd, &buf[*len], cap - *len)) != 0) {
+        if (nread == -1) {
+            if (errno == EINTR) continue;
+            die("read");
+        }
+        *len += nread;
+        if (*len == cap) {
+            cap *= 2;
+            buf = realloc(buf, cap);
+            if (buf == NULL) die("realloc");
+        }
+    }
+    return buf;
+}
+
+void editorLoadRows(char *buf, size_t len) {
+    /*
+    Builds every row of a freshly opened file in one go: all erows come
+    from a single allocation sized from the newline table, and each one
+    is a view of its line in buf.
+    */
+    size_t nNewlines;
+    size_t *nl = editorIndexLines(buf, len, &nNewlines);
+    size_t numRows = nNewlines;
+    if (len > 0 && buf[len - 1] != '\n') nl[numRows++] = len;
+
+    erow *rows = malloc(sizeof(erow) * (numRows ? numRows : 1));
+    if (rows == NULL) die("malloc");
+    size_t start = 0;
+    for (size_t i = 0; i < numRows; i++) {
+        size_t lineLen = nl[i] - start;
+        while (lineLen > 0 && buf[start + lineLen - 1] == '\r') lineLen--;
+
+        rows[i].size = lineLen;
+        rows[i].chars = &buf[start];
+        rows[i].flags = ROW_MAPPED | ROW_BLOCK;
+        rows[i].cap = 0;
+        rows[i].rSize = 0;
+        rows[i].render = NULL;
+        rows[i].hl = NULL;
+        rows[i].nHl = 0;
+        rows[i].hl_open_comment = 0;
+        rows[i].snap = 0;
+        rows[i].chunks = NULL;
+        rows[i].tabs = NULL;
+        rows[i].nTabs = 0;
+        start = nl[i] + 1;
+    }
+    free(nl);
+
+    rowTreeBuild(rows, numRows);
+    E.numRows = numRows;
+    // Nothing is rendered or highlighted until it is first drawn
+    E.syntaxStale = 0;
+    E.syntaxStaleEnd = E.numRows - 1;
+    editorQueueIdle(editorSyntaxIdle);
+}
+
+int editorWriteAll(int fd, struct iovec *iov, int n) {
+    // writev() that carries on after short writes and interruptions
+    while (n > 0) {
+        ssize_t nwritten = writev(fd, iov, n);
+        if (nwritten == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (n > 0 && (size_t)nwritten >= iov->iov_len) {
+            nwritten -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + nwritten;
+            iov->iov_len -= nwritten;
+        }
+    }
+    return 0;
+}
+
+int editorWriteRows(int fd, struct saveJob *job) {
+    /*
+    Streams the snapshot to fd straight from row storage, gathering each
+    row's chars and a shared newline into batches of iovecs. Nothing
+    is copied, so saving needs no memory beyond the batch.
+    */
+    static char newline = '\n';
+    struct iovec iov[KILO_SAVE_IOV];
+    int n = 0;
+    size_t batch = 0;
+
+    for (size_t i = 0; i < job->nRows; i++) {
+        iov[n] = job->rows[i];
+        iov[n + 1].iov_base = &newline;
+        iov[n + 1].iov_len = 1;
+        n += 2;
+        batch += job->rows[i].iov_len + 1;
+        if (n == KILO_SAVE_IOV || i == job->nRows - 1) {
+            if (editorWriteAll(fd, iov, n) == -1) return -1;
+            __atomic_add_fetch(&job->written, batch, __ATOMIC_RELAXED);
+            n = 0;
+            batch = 0;
+        }
+    }
+    return 0;
+}
+
+void *editorSaveWorker(void *arg) {
+    /*
+    The rows are written to a temporary file next to the target, synced,
+    and renamed over it, so a failed save leaves the old file whole.
+    It also leaves the file the rows are mapped from untouched: the
+    mapping keeps the old contents alive after the rename.
+    */
+    struct saveJob *job = arg;
+    char *tmpName = malloc(strlen(job->fileName) + 8);
+    sprintf(tmpName, "%s.XXXXXX", job->fileName);
+
+    int err = 0;
+    int fd = mkstemp(tmpName);
+    if (fd != -1) {
+        // Keep the permissions of the file being replaced
+        struct stat st;
+        fchmod(fd, stat(job->fileName, &st) == 0 ? st.st_mode & 07777 : 0644);
+
+        int ok = editorWriteRows(fd, job) == 0 && fsync(fd) == 0;
+        if (close(fd) == -1) ok = 0;
+        if (!ok || rename(tmpName, job->fileName) == -1) {
+            err = errno;
+            unlink(tmpName);
+        }
+    } else {
+        err = errno;
+    }
+    free(tmpName);
+
+    job->err = err;
+    __atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+    if (job->wake[1] != -1) write(job->wake[1], "", 1);
+    return NULL;
+}
+
+void editorOpen(char *filename) {
+    free(E.fileName);
+    E.fileName = strdup(filename);
+
+    editorSelectSyntaxHighlight();
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) die("open");
+
+    /*
+    Regular files are mapped rather than read, and each row starts
+    out as a view of its line in the mapping. Nothing is copied until
+    a row is edited. Anything that can't be mapped is read into memory
+    in large blocks and used the same way.
+    */
+    struct stat st;
+    if (fstat(fd, &st) == -1) die("fstat");
+    char *buf = NULL;
+    size_t len = 0;
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (buf == MAP_FAILED) buf = NULL;
+        else len = st.st_size;
+    }
+    if (buf == NULL) buf = editorReadAll(fd, &len);
+    close(fd);
+
+    E.map = buf;
+    E.mapLen = len;
+
+    editorLoadRows(buf, len);
+    E.dirty = 0;
+}
+
+void editorSaveFinish(void) {
+    // Waits for the worker and reports how the save went
+    struct saveJob *job = &E.save;
+    if (job->threaded) pthread_join(job->thread, NULL);
+    if (job->wake[0] != -1) {
+        close(job->wake[0]);
+        close(job->wake[1]);
+        job->wake[0] = job->wake[1] = -1;
+    }
+
+    for (size_t i = 0; i < job->nOrphans; i++)
+        poolFree(job->orphans[i].p, job->orphans[i].size);
+    job->nOrphans = 0;
+    free(job->rows);
+    job->rows = NULL;
+    free(job->fileName);
+    job->fileName = NULL;
+    job->active = 0;
+
+    if (job->err) {
+        editorSetStatusMessage("Can't save! I/O erro: %s", strerror(job->err));
+        return;
+    }
+    // Edits made while the save ran are still unsaved
+    if (E.dirty == job->dirty) E.dirty = 0;
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - job->start.tv_sec) +
+                  (end.tv_nsec - job->start.tv_nsec) / 1e9;
+    if (secs <= 0) secs = 1e-9;
+    editorSetStatusMessage("%zu bytes written to disk (%.1f MB/s)",
+                           job->total, job->total / secs / 1e6);
+}
+
+int editorSavePoll(void) {
+    /*
+    Called while waiting for input. Shows how far a background save
+    has got, or wraps it up once the worker is done. Returns whether
+    the message bar changed.
+    */
+    struct saveJob *job = &E.save;
+    if (!job->active) return 0;
+
+    if (__atomic_load_n(&job->done, __ATOMIC_ACQUIRE)) {
+        editorSaveFinish();
+    } else {
+        size_t written = __atomic_load_n(&job->written, __ATOMIC_RELAXED);
+        editorSetStatusMessage("Saving... %d%%",
+                               job->total ? (int)(written * 100 / job->total) : 0);
+    }
+    return 1;
+}
+
+void editorSaveWait(void) {
+    // Blocks until a background save has finished, e.g. before quitting
+    if (E.save.active) editorSaveFinish();
+}
+
+void editorSave(void) {
+    if (E.fileName == NULL) {
+        E.fileName = editorPrompt("Save as: %s", NULL, 0);
+        if (E.fileName == NULL) {
+            editorSetStatusMessage("Save aborted");
+            return;
+        }
+        editorSelectSyntaxHighlight();
+    }
+
+    struct saveJob *job = &E.save;
+    if (job->active) {
+        editorSetStatusMessage("A save is already in progress");
+        return;
+    }
+
+    /*
+    Takes a snapshot of where every row's chars are and hands it to a
+    worker thread, so editing can carry on while the file is written.
+    No text is copied up front: the rows are stamped with this save's
+    generation, and editorRowDetach() copies any of them that are edited
+    before the save is over.
+    */
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    job->gen++;
+    job->rows = malloc(sizeof(struct iovec) * (E.numRows ? E.numRows : 1));
+    if (job->rows == NULL) die("malloc");
+    job->nRows = 0;
+    job->total = 0;
+    if (E.gap.row) editorRowChars(E.gap.row);
+    rowIter it;
+    for (erow *row = rowIterSeek(&it, 0); row; row = rowIterNext(&it)) {
+        row->snap = job->gen;
+        job->rows[job->nRows].iov_base = row->chars;
+        job->rows[job->nRows].iov_len = row->size;
+        job->nRows++;
+        job->total += row->size + 1;
+    }
+    job->written = 0;
+    job->done = 0;
+    job->err = 0;
+    job->dirty = E.dirty;
+    job->fileName = strdup(E.fileName);
+    if (pipe(job->wake) == -1) job->wake[0] = job->wake[1] = -1;
+    job->active = 1;
+
+    job->threaded =
+        pthread_create(&job->thread, NULL, editorSaveWorker, job) == 0;
+    if (!job->threaded) editorSaveWorker(job);
+    editorSavePoll();
+}
+
+/*** Find ***/
+
+void editorFindPop(int len) {
+    // Drops the match sets of prefixes longer than len
+    while (E.find.nLevel > 0 && E.find.level[E.find.nLevel - 1].len > len)
+        free(E.find.level[--E.find.nLevel].hit);
+}
+
+void editorFindPush(struct findLevel lv) {
+    if (E.find.nLevel == E.find.levelCap) {
+        E.find.levelCap = E.find.levelCap ? E.find.levelCap * 2 : 16;
+        E.find.level = realloc(E.find.level,
+                               sizeof(struct findLevel) * E.find.levelCap);
+        if (E.find.level == NULL) die("realloc");
+    }
+    E.find.level[E.find.nLevel++] = lv;
+}
+
+void findHitAdd(struct findHit **hit, int *n, int *cap, int row, int cx, int len) {
+    if (*n == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        *hit = realloc(*hit, sizeof(struct findHit) * *cap);
+        if (*hit == NULL) die("realloc");
+    }
+    (*hit)[*n].row = row;
+    (*hit)[*n].cx = cx;
+    (*hit)[*n].len = len;
+    (*n)++;
+}
+
+int editorFindAt(struct findLevel *lv, int row, int cx) {
+    // Index of the first match at or after char cx of row
+    int lo = 0;
+    int hi = lv->n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        struct findHit *h = &lv->hit[mid];
+        if (h->row < row || (h->row == row && h->cx < cx)) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
 }
 
-void editorRowDeleteCharacter(erow *row, int at) {
-    if (at < 0 || at >= row->size) return;
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    editorUpdateRow(row);
-    E.dirty++;
+struct findLevel *editorFindTop(void) {
+    // Every match of the query, if they have all been found
+    int top = E.find.nLevel - 1;
+    if (top < 0 || E.find.qLen == 0 || E.find.level[top].len != E.find.qLen)
+        return NULL;
+    return &E.find.level[top];
 }
 
-/*** Editor Operations ***/
+struct findLevel *editorFindIndex(void) {
+    // The matches of the query found so far, in order, or NULL
+    struct findLevel *lv = editorFindTop();
+    if (lv == NULL && E.find.job.active && !E.find.job.overflow)
+        lv = &E.find.job.level;
+    return lv;
+}
 
-void editorInsertChar(int c) {
-    if (E.cy == E.numRows) {
-        editorInsertRow(E.numRows, "", 0);
+void *findWorker(void *arg) {
+    struct findJob *job = arg;
+    struct matcher m;
+    matcherFork(&m, &job->m);
+    while (!__atomic_load_n(&job->cancel, __ATOMIC_RELAXED)) {
+        int b = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (b >= job->nBlocks) break;
+
+        // Once the cap is reached matches are only counted. Other blocks
+        // only add to stored when they finish, so this block stops
+        // keeping matches by itself once it holds all the cap has left.
+        struct findBlock *blk = &job->block[b];
+        int keep = 1;
+        int cap = 0;
+        int at = b * KILO_FIND_BLOCK;
+        int end = at + KILO_FIND_BLOCK < E.numRows ? at + KILO_FIND_BLOCK : E.numRows;
+        rowIter it;
+        for (erow *row = rowIterSeek(&it, at); at < end; row = rowIterNext(&it), at++) {
+            int cx = 0;
+            int len;
+            while ((cx = matcherFind(&m, row->chars, row->size, cx, &len)) >= 0) {
+                blk->count++;
+                if (keep && __atomic_load_n(&job->stored, __ATOMIC_RELAXED) +
+                            blk->n >= job->max)
+                    keep = 0;
+                if (keep) findHitAdd(&blk->hit, &blk->n, &cap, at, cx, len);
+                cx = matcherAfter(&m, cx, len);
+            }
+        }
+        __atomic_add_fetch(&job->stored, blk->n, __ATOMIC_RELAXED);
+        __atomic_store_n(&blk->done, 1, __ATOMIC_RELEASE);
     }
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
-    E.cx++;
+    matcherFree(&m);
+    return NULL;
 }
 
-void editorInsertNewLine(void) {
-    if (E.cx == 0) {
-        editorInsertRow(E.cy, "", 0);
-    } else {
-        erow *row = &E.row[E.cy];
-        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-        row = &E.row[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
+void editorFindJoin(void) {
+    struct findJob *job = &E.find.job;
+    for (int t = 0; t < job->nThreads; t++) pthread_join(job->thread[t], NULL);
+    for (int b = 0; b < job->nBlocks; b++) free(job->block[b].hit);
+    free(job->block);
+    matcherFree(&job->m);
+    job->active = 0;
+}
+
+void editorFindCancel(void) {
+    // Stops a background search and throws away what it found
+    struct findJob *job = &E.find.job;
+    if (!job->active) return;
+    __atomic_store_n(&job->cancel, 1, __ATOMIC_RELAXED);
+    editorFindJoin();
+    free(job->level.hit);
+}
+
+int editorFindPoll(void) {
+    /*
+    Called while waiting for input. Joins the blocks the workers have
+    finished onto the match list, in order, and wraps the search up
+    once they are all in. Returns whether anything changed.
+    */
+    struct findJob *job = &E.find.job;
+    if (!job->active) return 0;
+
+    int from = job->merged;
+    while (job->merged < job->nBlocks &&
+           __atomic_load_n(&job->block[job->merged].done, __ATOMIC_ACQUIRE)) {
+        struct findBlock *blk = &job->block[job->merged++];
+        E.find.count += blk->count;
+        // A list with matches missing is no use, so only the count is kept
+        if (blk->n < blk->count && !job->overflow) {
+            job->overflow = 1;
+            free(job->level.hit);
+            job->level.hit = NULL;
+            job->level.n = 0;
+        }
+        if (!job->overflow && blk->n > 0) {
+            struct findLevel *lv = &job->level;
+            if (lv->n + blk->n > job->levelCap) {
+                job->levelCap = (lv->n + blk->n) * 2;
+                lv->hit = realloc(lv->hit, sizeof(struct findHit) * job->levelCap);
+                if (lv->hit == NULL) die("realloc");
+            }
+            memcpy(&lv->hit[lv->n], blk->hit, sizeof(struct findHit) * blk->n);
+            lv->n += blk->n;
+        }
+        free(blk->hit);
+        blk->hit = NULL;
     }
-    E.cy++;
-    E.cx = 0;
+    if (job->merged < job->nBlocks) return job->merged > from;
+
+    editorFindJoin();
+    if (job->overflow) free(job->level.hit);
+    else editorFindPush(job->level);
+    return 1;
 }
 
-void editorDeleteChar(void) {
-    if (E.cy == E.numRows) return;
-    if (E.cx == 0 && E.cy == 0) return;
+void editorFindStart(const char *query, int qLen, int max) {
+    /*
+    Starts looking for every match of query on as many threads as
+    there are cores, keeping up to max of them. A file of a single
+    block is searched right away.
+    */
+    struct findJob *job = &E.find.job;
+    editorFindCancel();
+    job->query = realloc(job->query, qLen + 1);
+    memcpy(job->query, query, qLen);
+    job->query[qLen] = '\0';
+    if (!matcherInit(&job->m, job->query, qLen, E.find.regex)) {
+        E.find.bad = 1;
+        E.find.count = -1;
+        return;
+    }
+    // The workers read chars directly, so no row may hold a gap
+    if (E.gap.row) editorRowChars(E.gap.row);
+    job->nBlocks = (E.numRows + KILO_FIND_BLOCK - 1) / KILO_FIND_BLOCK;
+    job->block = calloc(job->nBlocks ? job->nBlocks : 1, sizeof(struct findBlock));
+    if (job->block == NULL) die("calloc");
+    job->max = max;
+    job->next = job->cancel = job->stored = 0;
+    job->merged = job->overflow = 0;
+    job->level.len = qLen;
+    job->level.hit = NULL;
+    job->level.n = 0;
+    job->levelCap = 0;
+    job->active = 1;
+    E.find.count = 0;
+
+    long nThreads = job->nBlocks > 1 ? sysconf(_SC_NPROCESSORS_ONLN) : 0;
+    if (nThreads > KILO_MAX_THREADS) nThreads = KILO_MAX_THREADS;
+    if (nThreads > job->nBlocks) nThreads = job->nBlocks;
+    job->nThreads = 0;
+    while (job->nThreads < nThreads &&
+           pthread_create(&job->thread[job->nThreads], NULL, findWorker, job) == 0)
+        job->nThreads++;
+    if (job->nThreads == 0) findWorker(job);
+    editorFindPoll();
+}
 
-    erow *row = &E.row[E.cy];
-    if (E.cx > 0) {
-        editorRowDeleteCharacter(row, E.cx - 1);
-        E.cx--;
+void editorFindStale(int at) {
+    // Row at's matches are looked for again on the next refresh
+    if (E.find.staleFrom > E.find.staleTo) {
+        E.find.staleFrom = E.find.staleTo = at;
     } else {
-        E.cx = E.row[E.cy-1].size;
-        // Prev row is 1st arg, curr row is 2nd and 3rd
-        editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-        editorDelRow(E.cy);
-        E.cy--;
+        if (at < E.find.staleFrom) E.find.staleFrom = at;
+        if (at > E.find.staleTo) E.find.staleTo = at;
     }
 }
 
-/*** File I/O ***/
+void editorFindRowEdited(erow *row) {
+    if (E.find.nLevel > 0) editorFindStale(editorRowIndex(row));
+}
 
-char *editorRowsToString(int *bufLen) {
-    // Converts row of erow structs into a single string 
-    // that is ready to be written out to a file
-    int totLen = 0;
-    int j;
-    for (j = 0; j < E.numRows; j++) {
-        // Add 1 for '\n'
-        totLen += E.row[j].size + 1;
-    }
-    *bufLen = totLen;
-
-    char *buf = malloc(totLen);
-    char *p = buf;
-    for (j = 0; j < E.numRows; j++) {
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p += E.row[j].size;
-        *p = '\n';
-        p++;
-    }   
+void editorFindCharsEdited(erow *row, int at, int delta) {
+    /*
+    Keeps the match lists right across one char inserted at `at`
+    (delta 1) or deleted from there (delta -1). A query's matches are
+    as long as it is, so only those overlapping the edit can change:
+    they are looked for again in a window a query long either side of
+    it, and the row's later matches just move. A pattern's matches can
+    reach anywhere in the row, so then the row is searched again on the
+    next refresh.
+    */
+    if (E.find.nLevel == 0) return;
+    int y = editorRowIndex(row);
+    if (E.find.regex || (y >= E.find.staleFrom && y <= E.find.staleTo)) {
+        editorFindStale(y);
+        return;
+    }
 
-    return buf;
-}
+    for (int l = 0; l < E.find.nLevel; l++) {
+        struct findLevel *lv = &E.find.level[l];
+        int len = lv->len;
+        // Old matches starting in [lo, oldTo) overlap the edit, and new
+        // ones can start in [lo, newTo)
+        int lo = at - len + 1 > 0 ? at - len + 1 : 0;
+        int oldTo = delta > 0 ? at : at + 1;
+        int newTo = delta > 0 ? at + 1 : at;
+
+        int a = editorFindAt(lv, y, lo);
+        int b = editorFindAt(lv, y, oldTo);
+        int end = editorFindAt(lv, y + 1, 0);
+        for (int k = b; k < end; k++) lv->hit[k].cx += delta;
+
+        int wTo = newTo + len - 1 < row->size ? newTo + len - 1 : row->size;
+        struct findHit *fresh = NULL;
+        int n = 0;
+        int cap = 0;
+        if (wTo > lo) {
+            char *window = malloc(wTo - lo);
+            if (window == NULL) die("malloc");
+            editorRowCopy(row, lo, wTo, window);
+            struct matcher m;
+            matcherInit(&m, E.find.query, len, 0);
+            int cx = 0;
+            int mLen;
+            while ((cx = matcherFind(&m, window, wTo - lo, cx, &mLen)) >= 0 &&
+                   lo + cx < newTo) {
+                findHitAdd(&fresh, &n, &cap, y, lo + cx, mLen);
+                cx = matcherAfter(&m, cx, mLen);
+            }
+            matcherFree(&m);
+            free(window);
+        }
 
-void editorOpen(char *filename) {
-    free(E.fileName);
-    E.fileName = strdup(filename);
+        int total = lv->n - (b - a) + n;
+        if (n > b - a) {
+            lv->hit = realloc(lv->hit, sizeof(struct findHit) * total);
+            if (lv->hit == NULL) die("realloc");
+        }
+        memmove(&lv->hit[a + n], &lv->hit[b], sizeof(struct findHit) * (lv->n - b));
+        if (n) memcpy(&lv->hit[a], fresh, sizeof(struct findHit) * n);
+        lv->n = total;
+        free(fresh);
+    }
+    if (editorFindTop()) E.find.count = editorFindTop()->n;
+}
 
-    editorSelectSyntaxHighlight();
+void editorFindApplyMoves(void) {
+    /*
+    Renumbers the matches after the rows moved since the last call: the
+    rows at moveAt and after go down by moveBy, and if rows were
+    deleted their matches go. One pass over the lists however many
+    rows moved.
+    */
+    int at = E.find.moveAt;
+    int delta = E.find.moveBy;
+    if (delta == 0) return;
+    E.find.moveBy = 0;
+    for (int l = 0; l < E.find.nLevel; l++) {
+        struct findLevel *lv = &E.find.level[l];
+        int k = editorFindAt(lv, at, 0);
+        if (delta < 0) {
+            int end = editorFindAt(lv, at - delta, 0);
+            memmove(&lv->hit[k], &lv->hit[end], sizeof(struct findHit) * (lv->n - end));
+            lv->n -= end - k;
+        }
+        for (int i = k; i < lv->n; i++) lv->hit[i].row += delta;
+    }
+    if (editorFindTop()) E.find.count = editorFindTop()->n;
+}
 
-    FILE *fp = fopen(filename, "r");
-    if (!fp) die("fopen");
+void editorFindBatch(int on) {
+    // Between editorFindBatch(1) and editorFindBatch(0), runs of rows
+    // added or removed at one place are renumbered once, at the end
+    if (on) {
+        E.find.batch++;
+    } else if (--E.find.batch == 0) {
+        editorFindApplyMoves();
+    }
+}
 
-    char *line = NULL;
-    size_t lineCap = 0;
-    ssize_t lineLen;
-    while ((lineLen = getline(&line, &lineCap, fp)) != -1) {
-        while (lineLen > 0 && (line[lineLen - 1] == '\n' ||
-                               line[lineLen - 1] == '\r'))
-            lineLen--;
-        
-        editorInsertRow(E.numRows, line, lineLen);
+void editorFindRowsMoved(int at, int delta) {
+    /*
+    Keeps the match lists in step with a row inserted at `at` (delta 1)
+    or deleted from there (delta -1). Only the numbers of the rows
+    after it change; a new row is looked through on the next refresh.
+    Renumbering waits while a batch is open, as long as each row joins
+    the run before it: added right next to it, or removed from the
+    same place.
+    */
+    if (E.find.nLevel == 0) return;
+    int by = E.find.moveBy;
+    int joins = (by > 0 && delta > 0 && at >= E.find.moveAt &&
+                 at <= E.find.moveAt + by) ||
+                (by < 0 && delta < 0 && at == E.find.moveAt);
+    if (by && !joins) editorFindApplyMoves();
+    if (E.find.moveBy == 0) E.find.moveAt = at;
+    E.find.moveBy += delta;
+
+    if (E.find.staleFrom <= E.find.staleTo) {
+        if (E.find.staleFrom > at || (delta > 0 && E.find.staleFrom == at))
+            E.find.staleFrom += delta;
+        if (E.find.staleTo >= at) E.find.staleTo += delta;
     }
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
+    if (delta > 0) editorFindStale(at);
+    if (E.find.batch == 0) editorFindApplyMoves();
 }
 
-void editorSave(void) {
-    if (E.fileName == NULL) {
-        E.fileName = editorPrompt("Save as: %s", NULL);
-        if (E.fileName == NULL) {
-            editorSetStatusMessage("Save aborted");
-            return;
+void editorFindRefresh(void) {
+    /*
+    Looks through the rows edited since the match lists were last
+    brought up to date, and puts what it finds in place of their old
+    matches. Typing a char doesn't end up here unless the search is a
+    pattern; editorFindCharsEdited() deals with it on the spot.
+    */
+    int from = E.find.staleFrom;
+    int to = E.find.staleTo;
+    if (from > to) return;
+    E.find.staleFrom = 0;
+    E.find.staleTo = -1;
+    if (to >= E.numRows) to = E.numRows - 1;
+
+    // The row holding the gap is read from a copy, so the gap stays put
+    char *copy = NULL;
+    for (int l = 0; l < E.find.nLevel; l++) {
+        struct findLevel *lv = &E.find.level[l];
+        struct matcher m;
+        matcherInit(&m, E.find.query, lv->len, E.find.regex);
+        struct findHit *fresh = NULL;
+        int n = 0;
+        int cap = 0;
+        rowIter it;
+        int at = from;
+        for (erow *row = rowIterSeek(&it, from); row && at <= to;
+             row = rowIterNext(&it), at++) {
+            const char *chars = row->chars;
+            if (row == E.gap.row) {
+                if (copy == NULL) {
+                    copy = malloc(row->size + 1);
+                    if (copy == NULL) die("malloc");
+                    editorRowCopy(row, 0, row->size, copy);
+                }
+                chars = copy;
+            }
+            int cx = 0;
+            int len;
+            while ((cx = matcherFind(&m, chars, row->size, cx, &len)) >= 0) {
+                findHitAdd(&fresh, &n, &cap, at, cx, len);
+                cx = matcherAfter(&m, cx, len);
+            }
         }
-        editorSelectSyntaxHighlight();
+        matcherFree(&m);
+
+        int a = editorFindAt(lv, from, 0);
+        int b = editorFindAt(lv, to + 1, 0);
+        int total = lv->n - (b - a) + n;
+        if (n > b - a) {
+            lv->hit = realloc(lv->hit, sizeof(struct findHit) * total);
+            if (lv->hit == NULL) die("realloc");
+        }
+        memmove(&lv->hit[a + n], &lv->hit[b], sizeof(struct findHit) * (lv->n - b));
+        if (n) memcpy(&lv->hit[a], fresh, sizeof(struct findHit) * n);
+        lv->n = total;
+        free(fresh);
     }
+    free(copy);
+    if (editorFindTop()) E.find.count = editorFindTop()->n;
+}
 
-    int len;
-    char *buf = editorRowsToString(&len);
+struct findLevel *editorFindLevel(const char *query, int qLen) {
+    /*
+    Returns every match of query. A longer query can only match where
+    a prefix of it does, so it is built by rechecking the set of the
+    longest prefix still cached rather than by searching every row, and
+    after a backspace the set is usually still there. With no prefix
+    to go on, all rows are searched in the background and NULL is
+    returned until that is done. A pattern's prefix tells nothing
+    about where it matches, so patterns are always searched afresh,
+    though backspacing still finds the shorter ones' sets.
+    */
+    editorFindRefresh();
+    E.find.bad = 0;
+    int same = 0;
+    while (same < E.find.qLen && same < qLen && E.find.query[same] == query[same])
+        same++;
+    editorFindPop(same);
+    struct findJob *job = &E.find.job;
+    if (job->active && (job->level.len != qLen || memcmp(job->query, query, qLen)))
+        editorFindCancel();
+    E.find.query = realloc(E.find.query, qLen + 1);
+    memcpy(E.find.query, query, qLen + 1);
+    E.find.qLen = qLen;
+
+    struct findLevel *lv = editorFindTop();
+    if (lv) {
+        E.find.count = lv->n;
+        return lv;
+    }
+    if (qLen == 0) {
+        E.find.count = -1;
+        return NULL;
+    }
+    if (job->active) return NULL;
+    if (E.find.nLevel == 0 || E.find.regex) {
+        editorFindStart(query, qLen, KILO_FIND_MAX);
+        return editorFindTop();
+    }
 
-    // Open file to read/write or create file with 0644 permissions (r/w)
-    int fd = open(E.fileName, O_RDWR | O_CREAT, 0644);
-    if (fd != -1) {
-        if (ftruncate(fd, len) != -1) {
-            if (write(fd, buf, len) == len) {
-                close(fd);
-                free(buf);
-                E.dirty = 0;
-                editorSetStatusMessage("%d bytes written to disk", len);
-                return;
-            }
+    struct findLevel *from = &E.find.level[E.find.nLevel - 1];
+    struct findLevel next = { qLen, NULL, 0 };
+    int cap = 0;
+    rowIter it;
+    erow *row = NULL;
+    int at = -1;
+    for (int i = 0; i < from->n; i++) {
+        struct findHit h = from->hit[i];
+        // Rows close together are stepped to rather than looked up
+        if (row == NULL || h.row - at > 64) {
+            row = rowIterSeek(&it, h.row);
+        } else {
+            for (; at < h.row; at++) row = rowIterNext(&it);
         }
-        close(fd);
+        at = h.row;
+
+        if (h.cx + qLen > row->size) continue;
+        if (memcmp(editorRowSpan(row, h.cx, h.cx + qLen), query, qLen)) continue;
+        findHitAdd(&next.hit, &next.n, &cap, h.row, h.cx, qLen);
     }
-    free(buf);
-    editorSetStatusMessage("Can't save! I/O erro: %s", strerror(errno));
+    editorFindPush(next);
+    E.find.count = next.n;
+    return editorFindTop();
 }
 
-/*** Find ***/
+int editorFindNext(struct findLevel *lv, int row, int cx, int direction) {
+    // The match after (or before) the one at char cx of row, wrapping
+    if (lv->n == 0) return -1;
+    if (direction > 0) {
+        int k = editorFindAt(lv, row, cx + 1);
+        return k < lv->n ? k : 0;
+    }
+    int k = editorFindAt(lv, row, cx) - 1;
+    return k < 0 ? lv->n - 1 : k;
+}
+
+int editorFindDescribe(char *buf, int size) {
+    // "match N of M | " for the status bar while there is a query
+    buf[0] = '\0';
+    if (E.find.qLen == 0) return 0;
+    const char *kind = E.find.regex ? "regex " : "";
+    if (E.find.bad) return snprintf(buf, size, "bad regex | ");
+    if (E.find.count < 0) return 0;
+    // Still counting
+    const char *more = E.find.job.active ? "+" : "";
+    struct findLevel *lv = editorFindIndex();
+    if (lv) {
+        int k = editorFindAt(lv, E.cy, E.cx);
+        if (k < lv->n && lv->hit[k].row == E.cy && lv->hit[k].cx == E.cx)
+            return snprintf(buf, size, "%smatch %d of %d%s | ", kind, k + 1,
+                            E.find.count, more);
+    }
+    return snprintf(buf, size, "%s%d matches%s | ", kind, E.find.count, more);
+}
+
+int editorFindTypedAhead(void) {
+    // Whether a key is already waiting that will change the query
+    if (!editorKeyAvailable()) return 0;
+    int c = E.in.keys[E.in.keyHead % KILO_KEY_QUEUE];
+    return c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE ||
+           c == CTRL_KEY('r') || c == PASTE_EVENT || (c < 128 && !iscntrl(c));
+}
+
+void editorFindLabel(void) {
+    // E.find.prompt for E.find.verb's prompt in the current mode
+    snprintf(E.find.prompt, sizeof(E.find.prompt),
+             "%s%s: %%s (ESC/Arrows/Enter, ^R %s)", E.find.verb,
+             E.find.regex ? " (regex)" : "", E.find.regex ? "plain" : "regex");
+}
+
+void editorFindOpen(const char *verb) {
+    // Every prompt starts as a plain search
+    E.find.regex = E.find.bad = 0;
+    E.find.verb = verb;
+    editorFindLabel();
+}
 
 void editorFindCallback(char *query, int key) {
     static int last_match = -1;
+    static int last_cx = 0;
     static int direction = -1;
 
-    static int saved_hl_line;
-    static char *saved_hl = NULL;
-
-    if (saved_hl) {
-        memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rSize);
-        free(saved_hl);
-        saved_hl = NULL;
-    }
+    // The hit is drawn as an overlay, so nothing in the row to undo
+    E.match.row = -1;
 
     if (key == '\r' || key == '\x1b') {
         last_match = -1;
         direction = 1;
+        /*
+        A search still running is stopped before rows can be edited.
+        After Enter the query's matches stay highlighted and are kept
+        up to date as rows change; Escape drops them.
+        */
+        editorFindCancel();
+        struct findLevel *lv = key == '\r' ? editorFindTop() : NULL;
+        if (lv) {
+            struct findLevel keep = *lv;
+            E.find.nLevel--;
+            editorFindPop(0);
+            editorFindPush(keep);
+        } else {
+            editorFindPop(0);
+            E.find.qLen = 0;
+            E.find.count = -1;
+            E.find.bad = 0;
+        }
         return;
-    } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+    }
+
+    if (key == CTRL_KEY('r')) {
+        // Switches between plain and regex search; no old set applies
+        E.find.regex = !E.find.regex;
+        editorFindLabel();
+        editorFindCancel();
+        editorFindPop(0);
+        E.find.qLen = 0;
+        key = 0;
+    }
+
+    int qLen = strlen(query);
+    struct findLevel *lv;
+    if (key == ARROW_RIGHT || key == ARROW_DOWN) {
         direction = 1;
     } else if (key == ARROW_LEFT || key == ARROW_UP) {
         direction = -1;
@@ -718,32 +4815,97 @@ void editorFindCallback(char *query, int key) {
         last_match = -1;
         direction = 1;
     }
+    if (key == ARROW_RIGHT || key == ARROW_DOWN ||
+        key == ARROW_LEFT || key == ARROW_UP) {
+        lv = editorFindTop();
+    } else {
+        lv = editorFindLevel(query, qLen);
+    }
     if (last_match == -1) direction = 1;
     int current = last_match;
 
-    int i;
-    for (i = 0; i < E.numRows; i++) {
-        current += direction;
-        if (current == -1) current = E.numRows - 1;
-        else if (current == E.numRows) current = 0;
-
+    if (lv) {
+        /*
+        Steps one match at a time from the last one. It is found again
+        by position, as the set may have been rebuilt since.
+        */
+        int k = editorFindNext(lv, current, last_cx, direction);
+        if (k < 0) return;
+        erow *row = editorRowAt(lv->hit[k].row);
+        E.cx = last_cx = lv->hit[k].cx;
+        E.cy = last_match = lv->hit[k].row;
+        E.rowOff = E.numRows;
+
+        E.match.row = E.cy;
+        E.match.rx = editorRowCxToRx(row, E.cx);
+        E.match.len = editorRowCxToRx(row, E.cx + lv->hit[k].len) - E.match.rx;
+        return;
+    }
 
-        erow *row = &E.row[current];
-        char *match = strstr(row->render, query);
-        if (match) {
-            last_match = current;
-            E.cy = current;
-            E.cx = editorRowRxToCx(row, match - row->render);
-            E.rowOff = E.numRows;
+    /*
+    Rows are searched in chars as they are, so nothing is rendered or
+    highlighted on the way. Only the hit is converted to a column.
+    The walk is given up if the query changes before it is done, so
+    typing into a huge file doesn't wait on searches for every prefix.
+    A pattern search inside one long row gives up as soon as any key
+    is waiting, so the prompt never sits on a row it can't get through.
+    The rest of the last match's row is searched first, and the walk
+    ends back on it, so every match in a row is stepped through.
+    */
+    struct matcher m;
+    if (!matcherInit(&m, query, qLen, E.find.regex)) {
+        E.find.bad = 1;
+        return;
+    }
+    matcherGiveUp(&m, editorKeyAvailable);
+    rowIter it;
+    erow *row = NULL;
+    int stay = current >= 0 && current < E.numRows;
+    int i;
+    for (i = stay ? 0 : 1; i <= E.numRows; i++) {
+        if (i % KILO_FIND_BLOCK == KILO_FIND_BLOCK - 1 && editorFindTypedAhead())
+            break;
+        if (i > 0) {
+            current += direction;
+            if (current == -1) current = E.numRows - 1;
+            else if (current == E.numRows) current = 0;
+        }
 
+        if (row) row = direction > 0 ? rowIterNext(&it) : rowIterPrev(&it);
+        // The first row, and the other end once the walk wraps around
+        if (row == NULL) row = rowIterSeek(&it, current);
 
-            saved_hl_line = current;
-            saved_hl = malloc(row->rSize);
-            memcpy(saved_hl, row->hl, row->rSize);
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-            break;
+        const char *s = editorRowSpan(row, 0, row->size);
+        int len = 0;
+        int match = -1;
+        if (direction > 0) {
+            int from = i == 0 ? last_cx + 1 : 0;
+            if (from <= row->size) match = matcherFind(&m, s, row->size, from, &len);
+        } else {
+            // The last match that starts before the last one, or anywhere
+            int before = i == 0 ? last_cx : row->size + 1;
+            for (int at = 0; at <= row->size;) {
+                int l;
+                int k = matcherFind(&m, s, row->size, at, &l);
+                if (k < 0 || k >= before || matcherGaveUp(&m)) break;
+                match = k;
+                len = l;
+                at = k + 1;
+            }
         }
+        if (matcherGaveUp(&m)) break;
+        if (match < 0) continue;
+        E.cx = last_cx = match;
+        last_match = current;
+        E.cy = current;
+        E.rowOff = E.numRows;
+
+        E.match.row = current;
+        E.match.rx = editorRowCxToRx(row, E.cx);
+        E.match.len = editorRowCxToRx(row, E.cx + len) - E.match.rx;
+        break;
     }
+    matcherFree(&m);
 }
 
 void editorFind(void) {
@@ -752,7 +4914,8 @@ void editorFind(void) {
     int saved_colOff = E.colOff;
     int saved_rowOff = E.rowOff;
 
-    char *query = editorPrompt("Search: %s (ESC/Arrows/Enter)", editorFindCallback);
+    editorFindOpen("Search");
+    char *query = editorPrompt(E.find.prompt, editorFindCallback, 0);
     
     if (query) {
         free(query);
@@ -764,6 +4927,100 @@ void editorFind(void) {
     }
 }
 
+void editorReplaceAll(const char *query, const char *with) {
+    /*
+    Replaces every match of query with `with` as one batched edit.
+    The matches are found by the background search's workers, all of
+    them kept this time, and the editor waits for them. Each row with
+    matches is then rewritten once, and the rows' syntax is marked
+    stale once for the whole span, to be redone as rows are drawn.
+    The screen is only redrawn after the last row is done.
+    */
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    editorFindPop(0);
+    E.find.qLen = 0;
+    editorFindStart(query, strlen(query), INT_MAX);
+    while (E.find.job.active) {
+        if (!editorFindPoll()) poll(NULL, 0, 1);
+    }
+    E.match.row = -1;
+    // Only a pattern that doesn't parse leaves no match set
+    if (E.find.nLevel == 0) {
+        E.find.count = -1;
+        editorSetStatusMessage("Bad regex: %s", query);
+        return;
+    }
+    struct findLevel all = E.find.level[--E.find.nLevel];
+    E.find.count = -1;
+
+    int wLen = strlen(with);
+    int replaced = 0;
+    int rows = 0;
+    rowIter it;
+    erow *row = NULL;
+    int at = -1;
+    for (int i = 0; i < all.n;) {
+        int r = all.hit[i].row;
+        int j = i;
+        while (j < all.n && all.hit[j].row == r) j++;
+        // Rows close together are stepped to rather than looked up
+        if (row == NULL || r - at > 64) {
+            row = rowIterSeek(&it, r);
+        } else {
+            for (; at < r; at++) row = rowIterNext(&it);
+        }
+        at = r;
+        replaced += editorRowSplice(row, &all.hit[i], j - i, with, wLen);
+        rows++;
+        i = j;
+    }
+    if (rows) {
+        editorInvalidateSyntax(all.hit[0].row);
+        editorInvalidateSyntax(all.hit[all.n - 1].row);
+    }
+    free(all.hit);
+
+    if (E.cy < E.numRows && E.cx > editorRowAt(E.cy)->size)
+        E.cx = editorRowAt(E.cy)->size;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) +
+                  (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (secs <= 0) secs = 1e-9;
+    editorSetStatusMessage("Replaced %d matches in %d rows (%.0f replacements/s)",
+                           replaced, rows, replaced / secs);
+}
+
+void editorReplace(void) {
+    int saved_cx = E.cx;
+    int saved_cy = E.cy;
+    int saved_colOff = E.colOff;
+    int saved_rowOff = E.rowOff;
+
+    // The search prompt shows what will be replaced as it is typed
+    editorFindOpen("Replace");
+    char *query = editorPrompt(E.find.prompt, editorFindCallback, 0);
+    char *with = NULL;
+    if (query) with = editorPrompt("Replace with: %s (ESC to cancel)", NULL, 1);
+
+    if (with) {
+        editorReplaceAll(query, with);
+    } else {
+        editorFindPop(0);
+        E.find.qLen = 0;
+        E.find.count = -1;
+        E.match.row = -1;
+        E.cx = saved_cx;
+        E.cy = saved_cy;
+        E.rowOff = saved_rowOff;
+        E.colOff = saved_colOff;
+    }
+    free(query);
+    free(with);
+}
+
 
 /*** Append Buffer ***/
 
@@ -771,19 +5028,31 @@ struct abuf {
     // b is an array not a character jeez
     char *b;
     int len;
+    int cap; // bytes allocated for b
 };
 
 // represents empty buffer and acts as constructor for abuf type
-#define ABUF_INIT {NULL, 0}
+#define ABUF_INIT {NULL, 0, 0}
 
-void abAppend(struct abuf *ab, const char *s, int len) {
-    // make sure to allocate enough memory to hold old str + new str
-    // char [] is an array you dummy jeez
-    char *new = realloc(ab->b, ab->len + len);
+char *abReserve(struct abuf *ab, int len) {
+    /*
+    Makes room for len more bytes and returns where they go. The buffer
+    doubles when it runs out, so a buffer that is reused across frames
+    stops reallocating once it has grown to fit one.
+    */
+    if (ab->len + len > ab->cap) {
+        int cap = ab->cap ? ab->cap : 4096;
+        while (cap < ab->len + len) cap *= 2;
+        char *new = realloc(ab->b, cap);
+        if (new == NULL) die("realloc");
+        ab->b = new;
+        ab->cap = cap;
+    }
+    return &ab->b[ab->len];
+}
 
-    if (new == NULL) return;
-    memcpy(&new[ab->len], s, len);
-    ab->b = new;
+void abAppend(struct abuf *ab, const char *s, int len) {
+    memcpy(abReserve(ab, len), s, len);
     ab->len += len;
 }
 
@@ -791,12 +5060,213 @@ void abFree(struct abuf *ab) {
     free(ab->b);
 }
 
+/*** Frame Buffer ***/
+
+// SGR sequence for every cell attribute, and the attribute for every
+// editorHighlight value, both filled in by frameInitTables()
+char sgrSeq[CELL_ATTRS][12];
+int sgrLen[CELL_ATTRS];
+unsigned char hlAttr[HL_MATCH + 1];
+
+void frameInitTables(void) {
+    for (int a = 0; a < CELL_ATTRS; a++) {
+        sgrLen[a] = snprintf(sgrSeq[a], sizeof(sgrSeq[a]), "\x1b[%s;%dm",
+                             (a & CELL_INVERSE) ? "7" : "27", 30 + (a & 0xf));
+    }
+    for (int hl = 0; hl <= HL_MATCH; hl++) {
+        hlAttr[hl] = (hl == HL_NORMAL) ? CELL_DEFAULT
+                   : editorSyntaxToColor(hl) - 30;
+    }
+}
+
+void frameWrite(int y, int x, const char *s, int len, unsigned char attr) {
+    // Puts len characters into the frame being composed, clipped to the row
+    if (x >= E.screenCols) return;
+    if (len > E.screenCols - x) len = E.screenCols - x;
+    memcpy(&E.nextFrame.ch[y * E.screenCols + x], s, len);
+    memset(&E.nextFrame.attr[y * E.screenCols + x], attr, len);
+}
+
+void frameClear(frame *f) {
+    int n = (E.screenRows + 2) * E.screenCols;
+    memset(f->ch, ' ', n);
+    memset(f->attr, CELL_DEFAULT, n);
+}
+
+void frameResize(void) {
+    // (Re)allocates both frames for the current window size
+    int n = (E.screenRows + 2) * E.screenCols;
+    E.frame.ch = realloc(E.frame.ch, n);
+    E.frame.attr = realloc(E.frame.attr, n);
+    E.nextFrame.ch = realloc(E.nextFrame.ch, n);
+    E.nextFrame.attr = realloc(E.nextFrame.attr, n);
+    if (n && (!E.frame.ch || !E.frame.attr ||
+              !E.nextFrame.ch || !E.nextFrame.attr))
+        die("realloc");
+    E.frameValid = 0;
+}
+
+void abAppendMove(struct abuf *ab, int y, int x) {
+    // Cursor position sequence, formatted by hand to stay off snprintf
+    char *p = abReserve(ab, 32);
+    char *start = p;
+    int v[2] = { y + 1, x + 1 };
+    *p++ = '\x1b';
+    *p++ = '[';
+    for (int k = 0; k < 2; k++) {
+        char digits[12];
+        int n = 0;
+        do {
+            digits[n++] = '0' + v[k] % 10;
+            v[k] /= 10;
+        } while (v[k]);
+        while (n) *p++ = digits[--n];
+        *p++ = k ? 'H' : ';';
+    }
+    ab->len += p - start;
+}
+
+int frameRowWide(const char *ch, int cols) {
+    // Whether a row holds bytes of multi-byte characters
+    for (int x = 0; x < cols; x++)
+        if (ch[x] & 0x80) return 1;
+    return 0;
+}
+
+// Unchanged cells between two changes are rewritten rather than
+// jumped over when the gap is at most this wide
+#define FRAME_MAX_GAP 6
+
+void editorFlushFrame(struct abuf *ab) {
+    /*
+    Emits what it takes to turn the terminal's frame into the composed
+    one: for each row, a cursor move and the changed cells, runs that
+    are close together merged, and an erase for a cleared tail. Cells
+    of the same colour go out as one block behind a single SGR from
+    the table. A cell holds a byte, so a row with multi-byte characters
+    in either frame has columns that don't line up with the terminal's,
+    and is written out whole from its first column instead. When the frame isn't trusted (first draw, resize,
+    Ctrl-L) the screen is cleared and diffed against blanks, which
+    redraws everything.
+    */
+    if (!E.frameValid) {
+        abAppend(ab, "\x1b[m\x1b[2J", 7);
+        frameClear(&E.frame);
+        E.frameValid = 1;
+    }
+
+    int cols = E.screenCols;
+    int curY = -1, curX = -1;
+    unsigned char attr = CELL_DEFAULT;
+
+    for (int y = 0; y < E.screenRows + 2; y++) {
+        char *oldCh = &E.frame.ch[y * cols];
+        char *newCh = &E.nextFrame.ch[y * cols];
+        unsigned char *oldAttr = &E.frame.attr[y * cols];
+        unsigned char *newAttr = &E.nextFrame.attr[y * cols];
+
+        if (!memcmp(oldCh, newCh, cols) && !memcmp(oldAttr, newAttr, cols))
+            continue;
+
+        int whole = frameRowWide(oldCh, cols) || frameRowWide(newCh, cols);
+        int blankFrom = cols;
+        while (blankFrom > 0 && newCh[blankFrom - 1] == ' ' &&
+               newAttr[blankFrom - 1] == CELL_DEFAULT)
+            blankFrom--;
+
+        int x = 0;
+        while (x < cols) {
+            if (!whole && oldCh[x] == newCh[x] && oldAttr[x] == newAttr[x]) {
+                x++;
+                continue;
+            }
+
+            if (curY != y || curX != x) abAppendMove(ab, y, x);
+            curY = y;
+
+            if (x >= blankFrom) {
+                // Everything from here on is blank: erase instead of
+                // writing spaces
+                if (attr != CELL_DEFAULT) {
+                    abAppend(ab, "\x1b[m", 3);
+                    attr = CELL_DEFAULT;
+                }
+                abAppend(ab, "\x1b[K", 3);
+                curX = x;
+                break;
+            }
+
+            int end = x + 1;
+            int gap = 0;
+            while (end + gap < blankFrom && gap <= FRAME_MAX_GAP) {
+                if (!whole && oldCh[end + gap] == newCh[end + gap] &&
+                    oldAttr[end + gap] == newAttr[end + gap]) {
+                    gap++;
+                } else {
+                    end += gap + 1;
+                    gap = 0;
+                }
+            }
+
+            while (x < end) {
+                int run = x + 1;
+                while (run < end && newAttr[run] == newAttr[x]) run++;
+                if (newAttr[x] != attr) {
+                    attr = newAttr[x];
+                    abAppend(ab, sgrSeq[attr], sgrLen[attr]);
+                }
+                abAppend(ab, &newCh[x], run - x);
+                x = run;
+            }
+            curX = x;
+        }
+        if (whole && x == cols) {
+            // Multi-byte characters took fewer columns than bytes, so
+            // what the old row left past them has to go
+            if (attr != CELL_DEFAULT) {
+                abAppend(ab, "\x1b[m", 3);
+                attr = CELL_DEFAULT;
+            }
+            abAppend(ab, "\x1b[K", 3);
+        }
+    }
+    if (attr != CELL_DEFAULT) abAppend(ab, "\x1b[m", 3);
+
+    frame tmp = E.frame;
+    E.frame = E.nextFrame;
+    E.nextFrame = tmp;
+}
+
+void editorScrollFrame(struct abuf *ab, int shift) {
+    /*
+    Scrolls the text area by shift rows (up when positive) with a
+    scroll region and SU/SD, and shifts the shadow frame to match, so
+    only the rows that scrolled into view differ afterwards. The
+    status and message bars sit outside the region and stay put.
+    */
+    int n = abs(shift);
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r",
+                       E.screenRows, n, shift > 0 ? 'S' : 'T');
+    abAppend(ab, buf, len);
+
+    int cols = E.screenCols;
+    int kept = (E.screenRows - n) * cols;
+    int from = (shift > 0) ? n * cols : 0;
+    int to = (shift > 0) ? 0 : n * cols;
+    int exposed = (shift > 0) ? kept : 0;
+    memmove(&E.frame.ch[to], &E.frame.ch[from], kept);
+    memmove(&E.frame.attr[to], &E.frame.attr[from], kept);
+    memset(&E.frame.ch[exposed], ' ', n * cols);
+    memset(&E.frame.attr[exposed], CELL_DEFAULT, n * cols);
+}
+
 /*** Output ***/
 
 void editorScroll(void) {
     E.rx = 0;
     if (E.cy < E.numRows) {
-        E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+        E.rx = editorRowCxToRx(editorRowAt(E.cy), E.cx);
     }
 
     // Row offset is at the beginning of the screen
@@ -818,7 +5288,8 @@ void editorScroll(void) {
     }
 }
 
-void editorDrawRows(struct abuf *ab) {
+void editorDrawRows(void) {
+    struct findLevel *found = editorFindIndex();
     int y;
     for (y = 0; y < E.screenRows; y++) {
         int fileRow = y + E.rowOff;
@@ -830,116 +5301,137 @@ void editorDrawRows(struct abuf *ab) {
                     "Kilo editor -- version %s", KILO_VERSION);
                 if (welcomeLen > E.screenCols) welcomeLen = E.screenCols;
                 int padding = (E.screenCols - welcomeLen) / 2;
-                if (padding) {
-                    abAppend(ab, "~", 1);
-                    padding--;
-                }
-                while (padding--) abAppend(ab, " ", 1);
-                abAppend(ab, welcome, welcomeLen);
+                if (padding) frameWrite(y, 0, "~", 1, CELL_DEFAULT);
+                frameWrite(y, padding, welcome, welcomeLen, CELL_DEFAULT);
             } else {
-                abAppend(ab, "~", 1);
+                frameWrite(y, 0, "~", 1, CELL_DEFAULT);
             }
         } else {
-            int len = E.row[fileRow].rSize - E.colOff;
+            erow *row = editorRowHighlight(fileRow);
+            // A long row's render starts at rOff, at or left of colOff
+            int rOff = row->chunks ? row->chunks->rOff : 0;
+            int len = rOff + row->rSize - E.colOff;
             if (len < 0) len = 0;
             if (len > E.screenCols) len = E.screenCols;
-            char *c = &E.row[fileRow].render[E.colOff];
-            unsigned char *hl = &E.row[fileRow].hl[E.colOff];
-            int current_color = -1;
+            if (len == 0) continue;
+            const char *c = row->render ? &row->render[E.colOff - rOff] :
+                            editorRowSpan(row, E.colOff, E.colOff + len);
+            char *outCh = &E.nextFrame.ch[y * E.screenCols];
+            unsigned char *outAttr = &E.nextFrame.attr[y * E.screenCols];
+            memcpy(outCh, c, len);
+
+            // One fill per span, then the search hit on top
+            int from = E.colOff - rOff;
+            memset(outAttr, hlAttr[HL_NORMAL], len);
+            for (int k = editorRowSpanAt(row, from);
+                 k < row->nHl && row->hl[k].start < from + len; k++) {
+                struct hlSpan *sp = &row->hl[k];
+                int a = sp->start > from ? sp->start : from;
+                int b = sp->start + sp->len;
+                if (b > from + len) b = from + len;
+                memset(&outAttr[a - from], hlAttr[sp->hl], b - a);
+            }
+            // Every other match in view is shown in reverse video
+            if (found) {
+                // Pattern matches vary in length, so any may reach into view
+                int back = E.find.regex ? row->size : found->len - 1;
+                int k = editorFindAt(found, fileRow,
+                                     editorRowRxToCx(row, E.colOff) - back);
+                for (; k < found->n && found->hit[k].row == fileRow; k++) {
+                    int a = editorRowCxToRx(row, found->hit[k].cx);
+                    if (a >= E.colOff + len) break;
+                    int b = editorRowCxToRx(row, found->hit[k].cx + found->hit[k].len);
+                    if (a < E.colOff) a = E.colOff;
+                    if (b > E.colOff + len) b = E.colOff + len;
+                    for (int x = a; x < b; x++) outAttr[x - E.colOff] |= CELL_INVERSE;
+                }
+            }
+            if (fileRow == E.match.row) {
+                int a = E.match.rx > E.colOff ? E.match.rx : E.colOff;
+                int b = E.match.rx + E.match.len;
+                if (b > E.colOff + len) b = E.colOff + len;
+                if (a < b) memset(&outAttr[a - E.colOff], hlAttr[HL_MATCH], b - a);
+            }
+
             int j;
             for (j=0; j < len; j++) {
                 if (iscntrl(c[j])) {
-                    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-                    abAppend(ab, "\x1b[7m", 4);
-                    abAppend(ab, &sym, 1);
-                    abAppend(ab, "/x1b[m", 3);
-                    if (current_color != -1) {
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-                        abAppend(ab, buf, clen);
-                    }
-                } else if (hl[j] == HL_NORMAL) {
-                    if (current_color != -1) {                        
-                        abAppend(ab, "\x1b[39m", 5);
-                        current_color = -1;
-                    }
-                    abAppend(ab, &c[j], 1);
-                } else {
-                    int color = editorSyntaxToColor(hl[j]);
-                    if (color != current_color) { 
-                        current_color = color;
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                        abAppend(ab, buf, clen);
-                    }
-                    abAppend(ab, &c[j], 1);
+                    outCh[j] = (c[j] <= 26) ? '@' + c[j] : '?';
+                    outAttr[j] = CELL_DEFAULT | CELL_INVERSE;
                 }
             }
-            abAppend(ab,"\x1b[39m", 5); 
         }
-        // K erases current line with no argument
-        abAppend(ab, "\x1b[K", 3);
-        abAppend(ab, "\r\n", 2);        
     }
 }
 
-void editorDrawStatusBar(struct abuf *ab) {
-    // Escape sequence 7m for za inverted colors ya??
-    abAppend(ab, "\x1b[7m", 4);
+void editorDrawStatusBar(void) {
+    // The whole bar is drawn in inverted colours
+    int y = E.screenRows;
     char status[80], rStatus[80];
     int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
         E.fileName ? E.fileName : "[No Name]", E.numRows,
         E.dirty ? "(modified)" : "");
-    int rlen = snprintf(rStatus, sizeof(rStatus), "%s | %d/%d",
+    char found[48];
+    editorFindDescribe(found, sizeof(found));
+    int rlen = snprintf(rStatus, sizeof(rStatus), "%s%s | %d/%d", found,
         E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numRows);
     if (len > E.screenCols) len = E.screenCols;
-    abAppend(ab, status, len);
-    while (len < E.screenCols) {
-        if (E.screenCols - len == rlen) {
-            abAppend(ab, rStatus, rlen);
-            break;
-        } else {
-            abAppend(ab, " ", 1);
-            len++;
-        }
-    }
-    // Use za m to svitch back to za normal colors ya??
-    abAppend(ab, "\x1b[m", 3);
-    abAppend(ab, "\r\n", 2);
+    for (int x = 0; x < E.screenCols; x++)
+        frameWrite(y, x, " ", 1, CELL_DEFAULT | CELL_INVERSE);
+    frameWrite(y, 0, status, len, CELL_DEFAULT | CELL_INVERSE);
+    if (E.screenCols - len >= rlen)
+        frameWrite(y, E.screenCols - rlen, rStatus, rlen,
+                   CELL_DEFAULT | CELL_INVERSE);
 }
 
-void editorDrawMessageBar(struct abuf *ab) {
-    // esc sequence K clears message bar
-    abAppend(ab, "\x1b[K", 3);
+void editorDrawMessageBar(void) {
     int msgLen = strlen(E.statusmsg);
     if (msgLen > E.screenCols) msgLen = E.screenCols;
     // Only display the message if it is less than 5 seconds old
     if (msgLen && time(NULL) - E.statusmsg_time < 5)
-        abAppend(ab, E.statusmsg, msgLen);
+        frameWrite(E.screenRows + 1, 0, E.statusmsg, msgLen, CELL_DEFAULT);
+}
+
+void editorHandleResize(void) {
+    winResized = 0;
+    if (getWindowSize(&E.screenRows, &E.screenCols) == -1) die("getWindowSize");
+    E.screenRows -= 2;
+    frameResize();
 }
 
 void editorRefreshScreen(void) {
+    if (winResized) editorHandleResize();
+    editorFindRefresh();
     editorScroll();
-    
-    struct abuf ab = ABUF_INIT;
 
-    //clear screen then set cursor to top left
+    frameClear(&E.nextFrame);
+    editorDrawRows();
+    editorDrawStatusBar();
+    editorDrawMessageBar();
+
+    // The output buffer is kept from frame to frame, so once it has
+    // grown to fit a frame, drawing no longer allocates
+    static struct abuf ab = ABUF_INIT;
+    ab.len = 0;
+
+    // Hide the cursor while cells are being rewritten
     abAppend(&ab, "\x1b[?25l", 6);
-    abAppend(&ab, "\x1b[H", 3);
 
-    editorDrawRows(&ab);
-    editorDrawStatusBar(&ab);
-    editorDrawMessageBar(&ab);
+    // A pure vertical move is done by the terminal; only the rows that
+    // come into view are drawn
+    int shift = E.rowOff - E.frameRowOff;
+    if (E.frameValid && shift != 0 && abs(shift) < E.screenRows &&
+        E.colOff == E.frameColOff)
+        editorScrollFrame(&ab, shift);
+    E.frameRowOff = E.rowOff;
+    E.frameColOff = E.colOff;
 
-    char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowOff) + 1,
-                                              (E.rx - E.colOff) + 1);
-    abAppend(&ab, buf, strlen(buf));
+    editorFlushFrame(&ab);
 
+    abAppendMove(&ab, E.cy - E.rowOff, E.rx - E.colOff);
     abAppend(&ab, "\x1b[?25h", 6);
 
     write(STDOUT_FILENO, ab.b, ab.len);
-    abFree(&ab);
 }
 
 void editorSetStatusMessage(const char *fmt, ...) {
@@ -955,7 +5447,7 @@ void editorSetStatusMessage(const char *fmt, ...) {
 /*** Input Helper ***/
 
 void snapCursorX(void) {
-    erow *row = (E.cy >= E.numRows) ? NULL : &E.row[E.cy];
+    erow *row = (E.cy >= E.numRows) ? NULL : editorRowAt(E.cy);
     if (row && E.deadSnap < row->size) {
         E.cx = E.deadSnap;
     } else if (row) {
@@ -965,7 +5457,7 @@ void snapCursorX(void) {
 
 /*** Input ***/
 
-char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
+char *editorPrompt(char *prompt, void (*callback)(char *, int), int allowEmpty) {
     size_t bufsize = 128;
     char *buf = malloc(bufsize);
 
@@ -974,7 +5466,9 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 
     while (1) {
         editorSetStatusMessage(prompt, buf);
-        editorRefreshScreen();
+        // Typed-ahead keys are handled before the next frame is drawn
+        if (editorKeyAvailable()) editorScroll();
+        else editorRefreshScreen();
 
         int c = editorReadKey();
         if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
@@ -985,12 +5479,26 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
             free(buf);
             return NULL;
         } else if (c == '\r') {
-            if (buflen != 0) {
+            if (buflen != 0 || allowEmpty) {
                 editorSetStatusMessage("");
                 if (callback) callback(buf, c);
                 return buf;
             }
             // make sure c isn't a special character
+        } else if (c == PASTE_EVENT) {
+            // Only the first line of a paste makes sense in a prompt
+            for (size_t i = 0; i < E.in.pasteLen; i++) {
+                char p = E.in.paste[i];
+                if (p == '\r' || p == '\n') break;
+                if (iscntrl((unsigned char)p) || (unsigned char)p >= 128)
+                    continue;
+                if (buflen == bufsize - 1) {
+                    bufsize *= 2;
+                    buf = realloc(buf, bufsize);
+                }
+                buf[buflen++] = p;
+                buf[buflen] = '\0';
+            }
         } else if (!iscntrl(c) && c < 128) {
             if (buflen == bufsize - 1) {
                 bufsize *= 2;
@@ -1006,7 +5514,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 
 void editorMoveCursor(int key) {
     // Get current row
-    erow *row = (E.cy >= E.numRows) ? NULL : &E.row[E.cy];
+    erow *row = (E.cy >= E.numRows) ? NULL : editorRowAt(E.cy);
 
     switch (key) {
         case ARROW_LEFT:
@@ -1014,7 +5522,7 @@ void editorMoveCursor(int key) {
                 E.cx--;
             } else if (E.cy != 0) {
                 E.cy--;
-                E.cx = E.row[E.cy].size;
+                E.cx = editorRowAt(E.cy)->size;
             }
             E.deadSnap = E.cx;
 
@@ -1066,6 +5574,7 @@ void editorProcessKeypress(void) {
             return;
             }
 
+            editorSaveWait();
             write(STDOUT_FILENO, "\x1b[2J", 4);
             write(STDOUT_FILENO, "\x1b[H", 3);
             exit(0);
@@ -1081,13 +5590,17 @@ void editorProcessKeypress(void) {
 
         case END_KEY:
             if (E.cy < E.numRows)
-                E.cx = E.row[E.cy].size;
+                E.cx = editorRowAt(E.cy)->size;
             break;
 
         case CTRL_KEY('f'):
             editorFind();
             break;
 
+        case CTRL_KEY('r'):
+            editorReplace();
+            break;
+
         case BACKSPACE:
         case CTRL_KEY('h'):
         case DEL_KEY:
@@ -1120,6 +5633,14 @@ void editorProcessKeypress(void) {
             break;
 
         case CTRL_KEY('l'):
+            // Redraw everything in case the screen got garbled
+            E.frameValid = 0;
+            break;
+
+        case PASTE_EVENT:
+            editorInsertText(E.in.paste, E.in.pasteLen);
+            break;
+
         case '\x1b':
             break;
 
@@ -1144,31 +5665,99 @@ void initEditor(void) {
     E.rowOff = 0; // scrolled to top by default
     E.colOff = 0; // scrolled to start by default
     E.deadSnap = 0; // Holds column value when moving cursor to line without text
-    E.row = NULL;
+    E.rowRoot = NULL;
+    E.syntaxStale = 0;
+    E.syntaxStaleEnd = -1;
+    E.map = NULL;
+    E.mapLen = 0;
     E.dirty = 0;
     E.fileName = NULL;
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
     E.syntax = NULL;
+    E.in.rawHead = E.in.rawTail = 0;
+    E.in.keyHead = E.in.keyTail = 0;
+    E.in.state = IN_GROUND;
+    E.in.paste = NULL;
+    E.in.pasteLen = E.in.pasteCap = 0;
+    E.nIdle = 0;
+    E.save.active = 0;
+    E.save.gen = 0;
+    E.save.rows = NULL;
+    E.save.fileName = NULL;
+    E.save.orphans = NULL;
+    E.save.wake[0] = E.save.wake[1] = -1;
+    E.gap.row = NULL;
+    E.hlBuf = NULL;
+    E.hlBufCap = 0;
+    E.match.row = -1;
+    E.find.query = NULL;
+    E.find.qLen = 0;
+    E.find.regex = E.find.bad = 0;
+    E.find.level = NULL;
+    E.find.nLevel = E.find.levelCap = 0;
+    E.find.count = -1;
+    E.find.staleFrom = 0;
+    E.find.staleTo = -1;
+    E.find.moveAt = E.find.moveBy = E.find.batch = 0;
+    E.find.job.active = 0;
+    E.find.job.query = NULL;
+    memset(E.pool.free, 0, sizeof(E.pool.free));
+    E.pool.slab = NULL;
+    E.pool.slabLeft = 0;
+    E.save.nOrphans = E.save.orphanCap = 0;
+    E.lastFrame = 0;
 
     if (getWindowSize(&E.screenRows, &E.screenCols) == -1) die("getWindowSize");
     E.screenRows -= 2;
+    E.frame.ch = NULL;
+    E.frame.attr = NULL;
+    E.nextFrame.ch = NULL;
+    E.nextFrame.attr = NULL;
+    frameInitTables();
+    E.frameRowOff = 0;
+    E.frameColOff = 0;
+    frameResize();
     //sd
 }
 
+void handleSigWinch(int sig) {
+    (void)sig;
+    winResized = 1;
+}
+
 int main(int argc, char *argv[]) {
     enableRawMode();
     initEditor();
+    signal(SIGWINCH, handleSigWinch);
     if (argc >= 2) {
         editorOpen(argv[1]);
     }
 
     editorSetStatusMessage(
-        "HELP: Ctrl-S = save | Ctrl-Q = quit | CTRL-F = find");
+        "HELP: Ctrl-S = save | Ctrl-Q = quit | CTRL-F = find | Ctrl-R = replace");
 
+    /*
+    Each pass draws one frame, waits for a key, then handles every key
+    that is already waiting before drawing again. While keys keep
+    coming, as under key repeat, frames are held to one per
+    KILO_FRAME_MS and the keys that arrive in between join the batch.
+    */
     while (1) {
         editorRefreshScreen();
+        E.lastFrame = editorMillis();
         editorProcessKeypress();
+
+        while (1) {
+            if (editorKeyAvailable()) {
+                // Keys like page down work from the scroll offsets
+                editorScroll();
+                editorProcessKeypress();
+                continue;
+            }
+            long left = E.lastFrame + KILO_FRAME_MS - editorMillis();
+            if (left <= 0 || !editorWaitInput(left)) break;
+        }
     }
 
     return 0;